@@ -0,0 +1,267 @@
+/*
+ * tbench.c - Benchmark the registered transpose functions on real hardware
+ *
+ * The lab driver scores transpose functions by simulated misses on a 1KB
+ * direct mapped cache. This benchmark links against trans.c instead of the
+ * driver, collects the same functions through registerFunctions(), and runs
+ * each of them over a range of matrix sizes. For every (function, size) it
+ * reports the best wall time per call, the effective bandwidth (A read once
+ * plus B written once), and the L1D read misses and LLC misses per call
+ * counted with perf_event_open. Every call is checked with is_transpose();
+ * a wrong result is reported as FAIL for that size.
+ *
+ * With -b, it instead measures transpose_batch on BATCHCOUNT small matrices
+ * per call against a loop of transpose_fixed calls, in matrices/sec.
+ *
+ * Build: gcc -O2 -pthread -o tbench tbench.c trans.c
+ * Usage: ./tbench [-b] [-f <description substring>] [-d <MxN,...>] [-t <ms per run>]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#include "cachelab.h"
+
+/* Structure for a hardware cache miss counter */
+struct counter {
+	const char *name;
+	unsigned long long config;
+	int fd;
+};
+
+static struct counter counters[] = {
+	{ "L1D-miss", PERF_COUNT_HW_CACHE_L1D |
+		      (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+		      (PERF_COUNT_HW_CACHE_RESULT_MISS << 16), -1 },
+	{ "LLC-miss", PERF_COUNT_HW_CACHE_LL |
+		      (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+		      (PERF_COUNT_HW_CACHE_RESULT_MISS << 16), -1 },
+};
+#define NUMCOUNTERS (sizeof(counters) / sizeof(counters[0]))
+
+#define BATCHCOUNT 4096	/* Matrices per batched call */
+
+static trans_func_t funcs[MAX_TRANS_FUNCS];
+static int numfuncs = 0;
+
+void registerFunctions(void);
+int is_transpose(int M, int N, int A[N][M], int B[M][N]);
+void transpose_fixed(int M, int N, int A[N][M], int B[M][N]);
+void transpose_batch(int M, int N, int count, int *A, long astride, int *B, long bstride);
+
+/* registerTransFunction - Same interface as the lab driver, used by registerFunctions() */
+void registerTransFunction(void (*trans)(int M, int N, int[N][M], int[M][N]), char *desc)
+{
+	if (numfuncs == MAX_TRANS_FUNCS) {
+		fprintf(stderr, "tbench: too many transpose functions\n");
+		return;
+	}
+	funcs[numfuncs].func_ptr = trans;
+	funcs[numfuncs].description = desc;
+	numfuncs++;
+}
+
+/* Open the counters for this thread; counters the kernel refuses stay at fd -1 */
+static void open_counters(void)
+{
+	struct perf_event_attr attr;
+	unsigned i;
+
+	for (i = 0; i < NUMCOUNTERS; i++) {
+		memset(&attr, 0, sizeof(attr));
+		attr.size = sizeof(attr);
+		attr.type = PERF_TYPE_HW_CACHE;
+		attr.config = counters[i].config;
+		attr.disabled = 1;
+		attr.exclude_kernel = 1;
+		attr.exclude_hv = 1;
+		counters[i].fd = syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+	}
+}
+
+static long elapsed_ns(struct timespec *t0, struct timespec *t1)
+{
+	return (t1->tv_sec - t0->tv_sec) * 1000000000L + (t1->tv_nsec - t0->tv_nsec);
+}
+
+/* Run one function on one size and print a result line. Returns 0 if every call was correct */
+static int bench(trans_func_t *f, int M, int N, long mintime_ns)
+{
+	int *A, *B;
+	long reps = 0, total = 0, ns, best = -1;
+	unsigned long long count[NUMCOUNTERS] = { 0 };
+	unsigned long long val;
+	struct timespec t0, t1;
+	unsigned i;
+	long k;
+
+	if (posix_memalign((void **)&A, 64, sizeof(int) * M * N) ||
+	    posix_memalign((void **)&B, 64, sizeof(int) * M * N)) {
+		fprintf(stderr, "tbench: out of memory for %dx%d\n", M, N);
+		exit(1);
+	}
+	for (k = 0; k < (long)M * N; k++) {
+		A[k] = rand();
+		B[k] = 0;
+	}
+
+	while (reps < 3 || total < mintime_ns) {
+		for (i = 0; i < NUMCOUNTERS; i++) {
+			if (counters[i].fd >= 0) {
+				ioctl(counters[i].fd, PERF_EVENT_IOC_RESET, 0);
+				ioctl(counters[i].fd, PERF_EVENT_IOC_ENABLE, 0);
+			}
+		}
+		clock_gettime(CLOCK_MONOTONIC, &t0);
+		f->func_ptr(M, N, (int (*)[M])A, (int (*)[N])B);
+		clock_gettime(CLOCK_MONOTONIC, &t1);
+		for (i = 0; i < NUMCOUNTERS; i++) {
+			if (counters[i].fd >= 0) {
+				ioctl(counters[i].fd, PERF_EVENT_IOC_DISABLE, 0);
+				if (read(counters[i].fd, &val, sizeof(val)) == sizeof(val))
+					count[i] += val;
+			}
+		}
+
+		if (!is_transpose(M, N, (int (*)[M])A, (int (*)[N])B)) {
+			printf("%-45s %5dx%-5d FAIL\n", f->description, M, N);
+			free(A);
+			free(B);
+			return -1;
+		}
+
+		ns = elapsed_ns(&t0, &t1);
+		if (best < 0 || ns < best)
+			best = ns;
+		total += ns;
+		reps++;
+	}
+
+	printf("%-45s %5dx%-5d %12.2f us %8.2f GB/s", f->description, M, N,
+	       best / 1e3, 2.0 * sizeof(int) * M * N / best);
+	for (i = 0; i < NUMCOUNTERS; i++) {
+		if (counters[i].fd >= 0)
+			printf(" %12.0f %s", (double)count[i] / reps, counters[i].name);
+		else
+			printf(" %12s %s", "n/a", counters[i].name);
+	}
+	printf("\n");
+
+	free(A);
+	free(B);
+	return 0;
+}
+
+/* Run BATCHCOUNT MxN transposes per call, batched (batched=1) or one by one */
+static int bench_batch(int M, int N, int batched, long mintime_ns)
+{
+	int *A, *B;
+	long size = (long)M * N;
+	long reps = 0, total = 0, ns, best = -1;
+	struct timespec t0, t1;
+	long k;
+
+	A = malloc(sizeof(int) * size * BATCHCOUNT);
+	B = malloc(sizeof(int) * size * BATCHCOUNT);
+	if (A == NULL || B == NULL) {
+		fprintf(stderr, "tbench: out of memory for %dx%d batch\n", M, N);
+		exit(1);
+	}
+	for (k = 0; k < size * BATCHCOUNT; k++)
+		A[k] = rand();
+
+	while (reps < 3 || total < mintime_ns) {
+		clock_gettime(CLOCK_MONOTONIC, &t0);
+		if (batched)
+			transpose_batch(M, N, BATCHCOUNT, A, size, B, size);
+		else
+			for (k = 0; k < BATCHCOUNT; k++)
+				transpose_fixed(M, N, (int (*)[M])(A + k*size), (int (*)[N])(B + k*size));
+		clock_gettime(CLOCK_MONOTONIC, &t1);
+
+		for (k = 0; k < BATCHCOUNT; k++) {
+			if (!is_transpose(M, N, (int (*)[M])(A + k*size), (int (*)[N])(B + k*size))) {
+				printf("%-45s %5dx%-5d FAIL\n", batched ? "transpose_batch" : "transpose_fixed loop", M, N);
+				free(A);
+				free(B);
+				return -1;
+			}
+		}
+
+		ns = elapsed_ns(&t0, &t1);
+		if (best < 0 || ns < best)
+			best = ns;
+		total += ns;
+		reps++;
+	}
+
+	printf("%-45s %5dx%-5d %12.2f us %12.0f matrices/s\n", batched ? "transpose_batch" : "transpose_fixed loop",
+	       M, N, best / 1e3, BATCHCOUNT / (best / 1e9));
+
+	free(A);
+	free(B);
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	char defdims[] = "32x32,64x64,61x67,256x256,1024x1024,4096x4096";
+	char batchdims[] = "4x4,8x8,16x16,32x32,5x7";
+	char *dims = defdims;
+	char *filter = NULL;
+	char *tok;
+	long mintime_ns = 100000000L;
+	int opt, i, M, N, batch = 0, ret = 0;
+
+	while ((opt = getopt(argc, argv, "bf:d:t:")) != -1) {
+		switch (opt) {
+		case 'b':
+			batch = 1;
+			if (dims == defdims)
+				dims = batchdims;
+			break;
+		case 'f':
+			filter = optarg;
+			break;
+		case 'd':
+			dims = optarg;
+			break;
+		case 't':
+			mintime_ns = atol(optarg) * 1000000L;
+			break;
+		default:
+			fprintf(stderr, "Usage: %s [-b] [-f <description substring>] [-d <MxN,...>] [-t <ms per run>]\n", argv[0]);
+			return 1;
+		}
+	}
+
+	registerFunctions();
+	open_counters();
+	if (counters[0].fd < 0)
+		fprintf(stderr, "tbench: perf_event_open unavailable, miss counts are n/a\n");
+
+	for (tok = strtok(dims, ","); tok != NULL; tok = strtok(NULL, ",")) {
+		if (sscanf(tok, "%dx%d", &M, &N) != 2 || M <= 0 || N <= 0) {
+			fprintf(stderr, "tbench: bad shape %s\n", tok);
+			return 1;
+		}
+		if (batch) {
+			if (bench_batch(M, N, 0, mintime_ns) < 0 || bench_batch(M, N, 1, mintime_ns) < 0)
+				ret = 1;
+			continue;
+		}
+		for (i = 0; i < numfuncs; i++) {
+			if (filter != NULL && strstr(funcs[i].description, filter) == NULL)
+				continue;
+			if (bench(&funcs[i], M, N, mintime_ns) < 0)
+				ret = 1;
+		}
+	}
+
+	return ret;
+}
@@ -8,9 +8,27 @@
  * on a 1KB direct mapped cache with a block size of 32 bytes.
  */ 
 #include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <pthread.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
 #include "cachelab.h"
 
+/* Output size (bytes) from which transpose_large bypasses the cache for B */
+#ifndef NT_THRESHOLD
+#define NT_THRESHOLD (8 << 20)
+#endif
+
 int is_transpose(int M, int N, int A[N][M], int B[M][N]);
+int is_transpose_par(int M, int N, int A[N][M], int B[M][N], int nthreads);
+int is_transpose_sample(int M, int N, int A[N][M], int B[M][N], int k, unsigned seed);
+void transpose_inplace(int M, int N, int A[N][M]);
+void transpose_batch(int M, int N, int count, int *A, long astride, int *B, long bstride);
 
 /* 
  * transpose_submit - This is the solution transpose function that you
@@ -128,6 +146,353 @@ void trans(int M, int N, int A[N][M], int B[M][N])
 }
 */
 
+/*
+ * transpose_inplace_square - Swap the 8*8 blocks of A across the diagonal
+ */
+static void transpose_inplace_square(int N, int A[N][N])
+{
+    int i, j, ii, jj, tmp;
+
+    for(ii = 0; ii < N; ii += 8) {
+	/* Diagonal block: swap the elements above the diagonal with those below it */
+	for(i = ii; i < ii + 8 && i < N; i++) {
+	    for(j = i + 1; j < ii + 8 && j < N; j++) {
+		tmp = A[i][j];
+		A[i][j] = A[j][i];
+		A[j][i] = tmp;
+	    }
+	}
+	/* Off-diagonal blocks: swap block (ii, jj) with the transpose of block (jj, ii) */
+	for(jj = ii + 8; jj < N; jj += 8) {
+	    for(i = ii; i < ii + 8 && i < N; i++) {
+		for(j = jj; j < jj + 8 && j < N; j++) {
+		    tmp = A[i][j];
+		    A[i][j] = A[j][i];
+		    A[j][i] = tmp;
+		}
+	    }
+	}
+    }
+}
+
+/*
+ * next_pos - Position that the element at pos of the N x M matrix moves to
+ *     in its M x N transpose.
+ */
+static long next_pos(int M, int N, long pos)
+{
+    return (pos % M) * N + pos / M;
+}
+
+/*
+ * transpose_inplace_cycles - Move the elements of the N x M matrix at a
+ *     along the cycles of the transpose permutation.
+ */
+static void transpose_inplace_cycles(int M, int N, int *a)
+{
+    long size = (long)M * N;
+    long start, pos, next;
+    unsigned char *visited;
+    int val, tmp;
+
+    /* The first and the last elements never move */
+    visited = calloc((size + 7) / 8, 1);
+
+    for(start = 1; start < size - 1; start++) {
+	if(visited) {
+	    if(visited[start >> 3] & (1 << (start & 7)))
+		continue;
+	}
+	else {
+	    /* Out of memory for the bit vector: only move a cycle from its smallest position */
+	    for(pos = next_pos(M, N, start); pos > start; pos = next_pos(M, N, pos))
+		;
+	    if(pos < start)
+		continue;
+	}
+
+	val = a[start];
+	pos = start;
+	do {
+	    next = next_pos(M, N, pos);
+	    tmp = a[next];
+	    a[next] = val;
+	    val = tmp;
+	    if(visited)
+		visited[next >> 3] |= 1 << (next & 7);
+	    pos = next;
+	} while(pos != start);
+    }
+
+    free(visited);
+}
+
+/*
+ * transpose_inplace - Transpose A without a separate destination matrix.
+ *     On return, the buffer that held the N x M matrix A holds its
+ *     M x N transpose (i.e. it should be read as int [M][N]).
+ *
+ *     Square matrices are transposed by swapping 8*8 blocks across the
+ *     diagonal, so both blocks of a pair stay in the cache while they are
+ *     swapped. Non-square matrices follow the cycles of the transpose
+ *     permutation; a bit vector records the positions already moved so
+ *     each cycle is walked exactly once.
+ */
+void transpose_inplace(int M, int N, int A[N][M])
+{
+    if(M == N)
+	transpose_inplace_square(N, (int (*)[N])A);
+    else
+	transpose_inplace_cycles(M, N, &A[0][0]);
+}
+
+/*
+ * trans_inplace - Copy A to B and transpose B in place, so that
+ *     transpose_inplace can be checked and measured by the driver.
+ */
+char trans_inplace_desc[] = "In-place transpose of a copy";
+void trans_inplace(int M, int N, int A[N][M], int B[M][N])
+{
+    int i, j;
+    int *b = &B[0][0];
+
+    for (i = 0; i < N; i++) {
+        for (j = 0; j < M; j++) {
+            b[i*M + j] = A[i][j];
+        }
+    }
+    transpose_inplace(M, N, (int (*)[M])b);
+}
+
+/*
+ * transpose_tiled - Blocked transpose with T*T tiles for any shape.
+ *     It is always inlined, so when a caller passes constant M, N and T
+ *     the compiler sees fixed trip counts: the tail checks vanish for
+ *     shapes that are multiples of T and the tile loops can be unrolled.
+ */
+static inline __attribute__((always_inline))
+void transpose_tiled(int M, int N, int T, int A[N][M], int B[M][N])
+{
+    int i, j, ii, jj;
+
+    for(jj = 0; jj < M; jj += T) {
+	for(ii = 0; ii < N; ii += T) {
+	    for(i = ii; i < ii + T && (N % T == 0 || i < N); i++) {
+		for(j = jj; j < jj + T && (M % T == 0 || j < M); j++) {
+		    B[j][i] = A[i][j];
+		}
+	    }
+	}
+    }
+}
+
+/*
+ * FIXED_TRANSPOSE - Define trans_<M>x<N>, a copy of transpose_tiled
+ *     specialized for one shape and tile size.
+ */
+#define FIXED_TRANSPOSE(M, N, T)					\
+static void trans_##M##x##N(int A[N][M], int B[M][N])		\
+{									\
+    transpose_tiled(M, N, T, A, B);					\
+}
+
+FIXED_TRANSPOSE(32, 32, 8)
+FIXED_TRANSPOSE(64, 64, 8)
+FIXED_TRANSPOSE(61, 67, 16)
+FIXED_TRANSPOSE(256, 256, 8)
+
+/*
+ * transpose_fixed - Dispatch to a shape-specialized kernel when one exists,
+ *     otherwise run the generic blocked kernel with runtime bounds.
+ */
+char transpose_fixed_desc[] = "Shape-specialized blocked transpose";
+void transpose_fixed(int M, int N, int A[N][M], int B[M][N])
+{
+    if(M == 32 && N == 32)
+	trans_32x32(A, B);
+    else if(M == 64 && N == 64)
+	trans_64x64(A, B);
+    else if(M == 61 && N == 67)
+	trans_61x67(A, B);
+    else if(M == 256 && N == 256)
+	trans_256x256(A, B);
+    else
+	transpose_tiled(M, N, 8, A, B);
+}
+
+/*
+ * transpose_stream - Transpose writing B with non-temporal stores, so that a
+ *     B much larger than the last level cache neither evicts useful lines
+ *     nor costs a read-for-ownership per line. A 16*4 tile of A is read
+ *     as four 4*4 blocks, transposed in registers, and written as four
+ *     64-byte rows of B, i.e. whole cache lines. The edges are copied with
+ *     ordinary stores, and an sfence orders the streaming stores before
+ *     returning.
+ */
+char transpose_stream_desc[] = "Blocked transpose with streaming stores";
+void transpose_stream(int M, int N, int A[N][M], int B[M][N])
+{
+#ifdef __SSE2__
+    int i, j, ii, jj, k;
+    __m128i r0, r1, r2, r3, t0, t1, t2, t3;
+    __m128i row[4][4];
+
+    for(ii = 0; ii + 16 <= N; ii += 16) {
+	for(jj = 0; jj + 4 <= M; jj += 4) {
+	    /* Transpose four 4*4 blocks: row[j][k] holds B[jj+j][ii+4k .. ii+4k+3] */
+	    for(k = 0; k < 4; k++) {
+		r0 = _mm_loadu_si128((__m128i *)&A[ii + 4*k][jj]);
+		r1 = _mm_loadu_si128((__m128i *)&A[ii + 4*k + 1][jj]);
+		r2 = _mm_loadu_si128((__m128i *)&A[ii + 4*k + 2][jj]);
+		r3 = _mm_loadu_si128((__m128i *)&A[ii + 4*k + 3][jj]);
+		t0 = _mm_unpacklo_epi32(r0, r1);
+		t1 = _mm_unpacklo_epi32(r2, r3);
+		t2 = _mm_unpackhi_epi32(r0, r1);
+		t3 = _mm_unpackhi_epi32(r2, r3);
+		row[0][k] = _mm_unpacklo_epi64(t0, t1);
+		row[1][k] = _mm_unpackhi_epi64(t0, t1);
+		row[2][k] = _mm_unpacklo_epi64(t2, t3);
+		row[3][k] = _mm_unpackhi_epi64(t2, t3);
+	    }
+	    for(j = 0; j < 4; j++) {
+		for(k = 0; k < 4; k++) {
+		    int *dst = &B[jj + j][ii + 4*k];
+
+		    if(((uintptr_t)dst & 15) == 0) {
+			_mm_stream_si128((__m128i *)dst, row[j][k]);
+		    }
+		    else {
+			_mm_stream_si32(dst, _mm_cvtsi128_si32(row[j][k]));
+			_mm_stream_si32(dst + 1, _mm_cvtsi128_si32(_mm_srli_si128(row[j][k], 4)));
+			_mm_stream_si32(dst + 2, _mm_cvtsi128_si32(_mm_srli_si128(row[j][k], 8)));
+			_mm_stream_si32(dst + 3, _mm_cvtsi128_si32(_mm_srli_si128(row[j][k], 12)));
+		    }
+		}
+	    }
+	}
+	/* Columns left over on the right */
+	for(i = ii; i < ii + 16; i++) {
+	    for(j = jj; j < M; j++) {
+		B[j][i] = A[i][j];
+	    }
+	}
+    }
+    /* Rows left over at the bottom */
+    for(i = ii; i < N; i++) {
+	for(j = 0; j < M; j++) {
+	    B[j][i] = A[i][j];
+	}
+    }
+    _mm_sfence();
+#else
+    transpose_fixed(M, N, A, B);
+#endif
+}
+
+/*
+ * transpose_large - Pick the kernel by the size of B: streaming stores once
+ *     B is at least NT_THRESHOLD bytes, the cached kernels below that.
+ */
+char transpose_large_desc[] = "Size-dispatched transpose";
+void transpose_large(int M, int N, int A[N][M], int B[M][N])
+{
+    if((size_t)M * N * sizeof(int) >= NT_THRESHOLD)
+	transpose_stream(M, N, A, B);
+    else
+	transpose_fixed(M, N, A, B);
+}
+
+#ifdef __SSE2__
+/*
+ * transpose_block4 - Transpose the 4*4 block held in the rows r0..r3
+ */
+static inline void transpose_block4(__m128i *r0, __m128i *r1, __m128i *r2, __m128i *r3)
+{
+    __m128i t0 = _mm_unpacklo_epi32(*r0, *r1);
+    __m128i t1 = _mm_unpacklo_epi32(*r2, *r3);
+    __m128i t2 = _mm_unpackhi_epi32(*r0, *r1);
+    __m128i t3 = _mm_unpackhi_epi32(*r2, *r3);
+
+    *r0 = _mm_unpacklo_epi64(t0, t1);
+    *r1 = _mm_unpackhi_epi64(t0, t1);
+    *r2 = _mm_unpacklo_epi64(t2, t3);
+    *r3 = _mm_unpackhi_epi64(t2, t3);
+}
+#endif
+
+/*
+ * transpose_batch - Transpose count N x M matrices at A, A + astride, ...
+ *     into the M x N matrices at B, B + bstride, ... (strides in ints).
+ *     Shapes that are multiples of 4 are cut into 4*4 blocks transposed in
+ *     registers; with AVX2 the two 128-bit lanes of each register hold rows
+ *     of two different matrices, so one shuffle sequence transposes the
+ *     same block of two matrices at once. Other shapes use scalar copies.
+ */
+void transpose_batch(int M, int N, int count, int *A, long astride, int *B, long bstride)
+{
+    int k = 0, i, j;
+
+#ifdef __SSE2__
+    if(M % 4 == 0 && N % 4 == 0) {
+	int r;
+#ifdef __AVX2__
+	__m256i v[4], t[4];
+
+	for(; k + 2 <= count; k += 2) {
+	    int *a0 = A + k*astride, *a1 = a0 + astride;
+	    int *b0 = B + k*bstride, *b1 = b0 + bstride;
+
+	    for(i = 0; i < N; i += 4) {
+		for(j = 0; j < M; j += 4) {
+		    for(r = 0; r < 4; r++)
+			v[r] = _mm256_inserti128_si256(
+			    _mm256_castsi128_si256(_mm_loadu_si128((__m128i *)&a0[(i+r)*M + j])),
+			    _mm_loadu_si128((__m128i *)&a1[(i+r)*M + j]), 1);
+		    t[0] = _mm256_unpacklo_epi32(v[0], v[1]);
+		    t[1] = _mm256_unpacklo_epi32(v[2], v[3]);
+		    t[2] = _mm256_unpackhi_epi32(v[0], v[1]);
+		    t[3] = _mm256_unpackhi_epi32(v[2], v[3]);
+		    v[0] = _mm256_unpacklo_epi64(t[0], t[1]);
+		    v[1] = _mm256_unpackhi_epi64(t[0], t[1]);
+		    v[2] = _mm256_unpacklo_epi64(t[2], t[3]);
+		    v[3] = _mm256_unpackhi_epi64(t[2], t[3]);
+		    for(r = 0; r < 4; r++) {
+			_mm_storeu_si128((__m128i *)&b0[(j+r)*N + i], _mm256_castsi256_si128(v[r]));
+			_mm_storeu_si128((__m128i *)&b1[(j+r)*N + i], _mm256_extracti128_si256(v[r], 1));
+		    }
+		}
+	    }
+	}
+#endif
+	__m128i w[4];
+
+	for(; k < count; k++) {
+	    int *a = A + k*astride, *b = B + k*bstride;
+
+	    for(i = 0; i < N; i += 4) {
+		for(j = 0; j < M; j += 4) {
+		    for(r = 0; r < 4; r++)
+			w[r] = _mm_loadu_si128((__m128i *)&a[(i+r)*M + j]);
+		    transpose_block4(&w[0], &w[1], &w[2], &w[3]);
+		    for(r = 0; r < 4; r++)
+			_mm_storeu_si128((__m128i *)&b[(j+r)*N + i], w[r]);
+		}
+	    }
+	}
+	return;
+    }
+#endif
+    for(; k < count; k++) {
+	int *a = A + k*astride, *b = B + k*bstride;
+
+	for(i = 0; i < N; i++) {
+	    for(j = 0; j < M; j++) {
+		b[j*N + i] = a[i*M + j];
+	    }
+	}
+    }
+}
+
 /*
  * registerFunctions - This function registers your transpose
  *     functions with the driver.  At runtime, the driver will
@@ -142,25 +507,193 @@ void registerFunctions()
 
     /* Register any additional transpose functions */
     // registerTransFunction(trans, trans_desc); 
+    registerTransFunction(trans_inplace, trans_inplace_desc);
+    registerTransFunction(transpose_fixed, transpose_fixed_desc);
+    registerTransFunction(transpose_stream, transpose_stream_desc);
+    registerTransFunction(transpose_large, transpose_large_desc);
+
+}
+
+/* Side of the square tiles compared by the is_transpose family */
+#define CHECK_TILE 64
+
+/*
+ * check_tile - Check B against A over the rows [ii, ie) and columns [jj, je)
+ *     of A. Full 4*4 blocks of A are transposed in SSE2 registers and
+ *     compared with four contiguous rows of B, so B is read along its rows.
+ *     Returns 0 at the first mismatch.
+ */
+static int check_tile(int M, int N, int A[N][M], int B[M][N], int ii, int ie, int jj, int je)
+{
+    int i, j;
+#ifdef __SSE2__
+    __m128i r0, r1, r2, r3, t0, t1, t2, t3, eq;
+
+    for (i = ii; i + 4 <= ie; i += 4) {
+        for (j = jj; j + 4 <= je; j += 4) {
+            r0 = _mm_loadu_si128((__m128i *)&A[i][j]);
+            r1 = _mm_loadu_si128((__m128i *)&A[i+1][j]);
+            r2 = _mm_loadu_si128((__m128i *)&A[i+2][j]);
+            r3 = _mm_loadu_si128((__m128i *)&A[i+3][j]);
+            t0 = _mm_unpacklo_epi32(r0, r1);
+            t1 = _mm_unpacklo_epi32(r2, r3);
+            t2 = _mm_unpackhi_epi32(r0, r1);
+            t3 = _mm_unpackhi_epi32(r2, r3);
+            eq = _mm_and_si128(
+                _mm_and_si128(
+                    _mm_cmpeq_epi32(_mm_unpacklo_epi64(t0, t1), _mm_loadu_si128((__m128i *)&B[j][i])),
+                    _mm_cmpeq_epi32(_mm_unpackhi_epi64(t0, t1), _mm_loadu_si128((__m128i *)&B[j+1][i]))),
+                _mm_and_si128(
+                    _mm_cmpeq_epi32(_mm_unpacklo_epi64(t2, t3), _mm_loadu_si128((__m128i *)&B[j+2][i])),
+                    _mm_cmpeq_epi32(_mm_unpackhi_epi64(t2, t3), _mm_loadu_si128((__m128i *)&B[j+3][i]))));
+            if (_mm_movemask_epi8(eq) != 0xffff) {
+                return 0;
+            }
+        }
+        /* Columns left over on the right of the 4-row strip */
+        for (; j < je; j++) {
+            if (A[i][j] != B[j][i] || A[i+1][j] != B[j][i+1] ||
+                A[i+2][j] != B[j][i+2] || A[i+3][j] != B[j][i+3]) {
+                return 0;
+            }
+        }
+    }
+#else
+    i = ii;
+#endif
+    /* Rows left over at the bottom (all rows without SSE2) */
+    for (; i < ie; i++) {
+        for (j = jj; j < je; j++) {
+            if (A[i][j] != B[j][i]) {
+                return 0;
+            }
+        }
+    }
+    return 1;
+}
+
+/* Structure for the work of one is_transpose_par thread */
+struct check_arg {
+    int M, N;
+    int *A, *B;
+    int first, step;		/* Tile rows first, first + step, ... */
+    int *failed;		/* Shared early-exit flag, accessed atomically */
+};
+
+static void *check_thread(void *vp)
+{
+    struct check_arg *arg = vp;
+    int M = arg->M, N = arg->N;
+    int (*A)[M] = (int (*)[M])arg->A;
+    int (*B)[N] = (int (*)[N])arg->B;
+    int ii, jj;
+
+    for (ii = arg->first * CHECK_TILE; ii < N; ii += arg->step * CHECK_TILE) {
+        for (jj = 0; jj < M; jj += CHECK_TILE) {
+            if (__atomic_load_n(arg->failed, __ATOMIC_RELAXED)) {
+                return NULL;
+            }
+            if (!check_tile(M, N, A, B, ii, ii + CHECK_TILE < N ? ii + CHECK_TILE : N,
+                            jj, jj + CHECK_TILE < M ? jj + CHECK_TILE : M)) {
+                __atomic_store_n(arg->failed, 1, __ATOMIC_RELAXED);
+                return NULL;
+            }
+        }
+    }
+    return NULL;
+}
+
+/*
+ * is_transpose_par - is_transpose split over nthreads threads by tile rows.
+ *     The first thread to find a mismatch stops the others.
+ *     nthreads below 1 is taken as 1.
+ */
+int is_transpose_par(int M, int N, int A[N][M], int B[M][N], int nthreads)
+{
+    if (nthreads < 1) {
+        nthreads = 1;
+    }
+
+    pthread_t tid[nthreads];
+    struct check_arg arg[nthreads];
+    int failed = 0;
+    int t, started;
 
+    for (t = 0; t < nthreads; t++) {
+        arg[t].M = M;
+        arg[t].N = N;
+        arg[t].A = &A[0][0];
+        arg[t].B = &B[0][0];
+        arg[t].first = t;
+        arg[t].step = nthreads;
+        arg[t].failed = &failed;
+    }
+    /* Thread 0's share runs on the calling thread */
+    for (started = 1; started < nthreads; started++) {
+        if (pthread_create(&tid[started], NULL, check_thread, &arg[started]) != 0) {
+            break;
+        }
+    }
+    check_thread(&arg[0]);
+    /* Shares whose thread could not be started also run here */
+    for (t = started; t < nthreads; t++) {
+        check_thread(&arg[t]);
+    }
+    for (t = 1; t < started; t++) {
+        pthread_join(tid[t], NULL);
+    }
+    return !__atomic_load_n(&failed, __ATOMIC_RELAXED);
+}
+
+/*
+ * is_transpose_sample - Spot check: compare k tiles chosen at random.
+ *     Returns 0 if a sampled tile is wrong; 1 means only that no
+ *     error was found in the sample.
+ */
+int is_transpose_sample(int M, int N, int A[N][M], int B[M][N], int k, unsigned seed)
+{
+    int tiles_i = (N + CHECK_TILE - 1) / CHECK_TILE;
+    int tiles_j = (M + CHECK_TILE - 1) / CHECK_TILE;
+    unsigned x = seed ? seed : 1;
+    int ii, jj;
+
+    /* Nothing to sample in an empty matrix */
+    if (M <= 0 || N <= 0 || k <= 0) {
+        return 1;
+    }
+
+    while (k-- > 0) {
+        /* xorshift32 */
+        x ^= x << 13;
+        x ^= x >> 17;
+        x ^= x << 5;
+        ii = (x % tiles_i) * CHECK_TILE;
+        jj = ((x / tiles_i) % tiles_j) * CHECK_TILE;
+        if (!check_tile(M, N, A, B, ii, ii + CHECK_TILE < N ? ii + CHECK_TILE : N,
+                        jj, jj + CHECK_TILE < M ? jj + CHECK_TILE : M)) {
+            return 0;
+        }
+    }
+    return 1;
 }
 
 /* 
  * is_transpose - This helper function checks if B is the transpose of
  *     A. You can check the correctness of your transpose by calling
  *     it before returning from the transpose function.
+ *     The check runs tile by tile and returns at the first mismatch.
  */
 int is_transpose(int M, int N, int A[N][M], int B[M][N])
 {
-    int i, j;
+    int ii, jj;
 
-    for (i = 0; i < N; i++) {
-        for (j = 0; j < M; ++j) {
-            if (A[i][j] != B[j][i]) {
+    for (ii = 0; ii < N; ii += CHECK_TILE) {
+        for (jj = 0; jj < M; jj += CHECK_TILE) {
+            if (!check_tile(M, N, A, B, ii, ii + CHECK_TILE < N ? ii + CHECK_TILE : N,
+                            jj, jj + CHECK_TILE < M ? jj + CHECK_TILE : M)) {
                 return 0;
             }
         }
     }
     return 1;
 }
-
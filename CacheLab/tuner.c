@@ -0,0 +1,317 @@
+/*
+ * tuner.c - Search transpose blocking parameters against the csim cache model
+ *
+ * transpose_submit in trans.c uses 8*8 blocks and a reverse-row trick that
+ * were picked by hand for one 1KB direct mapped cache. This tool enumerates
+ * the same family of kernels instead:
+ *
+ *   tile size	    bh x bw, each a power of two from 2 up to 32
+ *   traversal	    row-major or column-major order of the tiles
+ *   split	    0: every row of a tile is copied left to right
+ *		    1: the right half of a tile is copied bottom-up (64x64 trick)
+ *   diagonal	    none:   copy element by element
+ *		    defer:  hold the diagonal element and store it after the row
+ *		    rowbuf: load a whole tile row into locals, then store it
+ *
+ * Each candidate is scored twice. Its access trace is written in the
+ * valgrind format read by csim and run through csim with the given cache
+ * geometry, and the kernel itself is timed on the real matrices. The best
+ * candidate by misses and the best one by time are printed per shape as
+ *
+ *   <M> <N> <s> <E> <b> <misses|time> tile=<bh>x<bw> order=<row|col>
+ *	split=<0|1> diag=<none|defer|rowbuf> misses=<n> ns=<ns per element>
+ *
+ * Usage: ./tuner [-v] [-s <s>] [-E <E>] [-b <b>] [-c <csim>] [-d <MxN,...>]
+ *   defaults: -s 5 -E 1 -b 5 -c ./csim -d 32x32,64x64,61x67
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <unistd.h>
+#include <time.h>
+
+/* Matrices are traced as if they were the two 256x256 static arrays of the
+ * lab's tracegen, i.e. B starts exactly 256KB after A. */
+#define ABASE 0x602100UL
+#define BBASE (ABASE + 256*256*sizeof(int))
+
+#define MAXTILE 32
+#define MINTIME_NS 20000000L	/* Time each candidate for at least 20ms */
+
+enum order { ORDER_ROW, ORDER_COL };
+enum diag { DIAG_NONE, DIAG_DEFER, DIAG_ROWBUF };
+
+static const char *order_name[] = { "row", "col" };
+static const char *diag_name[] = { "none", "defer", "rowbuf" };
+
+/* Structure for a candidate kernel configuration and its scores */
+struct cand {
+	int bh, bw;
+	enum order order;
+	int split;
+	enum diag diag;
+	int misses;
+	double ns;
+};
+
+static FILE *trace_fp;
+
+static void trace_access(char op, unsigned long base, int cols, int i, int j)
+{
+	fprintf(trace_fp, " %c %lx,4\n", op, base + (unsigned long)(i*cols + j)*sizeof(int));
+}
+
+/* In a traced kernel every access is written to trace_fp; in a native one
+ * 'traced' is constant zero and the branch is folded away. */
+#define RD(i, j) (traced ? (trace_access('L', ABASE, M, i, j), A[(i)*M + (j)]) : A[(i)*M + (j)])
+#define WR(i, j, v) do { if (traced) trace_access('S', BBASE, N, i, j); B[(i)*N + (j)] = (v); } while (0)
+
+/* Copy the rows [ii, ie) of the columns [js, je) of A into B */
+static inline __attribute__((always_inline))
+void copy_segment(const struct cand *c, int M, int N, const int *A, int *B,
+		  int ii, int ie, int js, int je, int reverse, int traced)
+{
+	int i, j, k, d = 0, hasd;
+	int buf[MAXTILE];
+
+	for (k = 0; k < ie - ii; k++) {
+		i = reverse ? ie - 1 - k : ii + k;
+		switch (c->diag) {
+		case DIAG_NONE:
+			for (j = js; j < je; j++)
+				WR(j, i, RD(i, j));
+			break;
+		case DIAG_DEFER:
+			hasd = 0;
+			for (j = js; j < je; j++) {
+				if (i == j) {
+					d = RD(i, j);
+					hasd = 1;
+				}
+				else
+					WR(j, i, RD(i, j));
+			}
+			if (hasd)
+				WR(i, i, d);
+			break;
+		case DIAG_ROWBUF:
+			for (j = js; j < je; j++)
+				buf[j - js] = RD(i, j);
+			for (j = js; j < je; j++)
+				WR(j, i, buf[j - js]);
+			break;
+		}
+	}
+}
+
+static inline __attribute__((always_inline))
+void kernel(const struct cand *c, int M, int N, const int *A, int *B, int traced)
+{
+	int ii, jj, ie, je, jm;
+	int nt_i = (N + c->bh - 1) / c->bh;
+	int nt_j = (M + c->bw - 1) / c->bw;
+	int t, ti, tj;
+
+	for (t = 0; t < nt_i * nt_j; t++) {
+		if (c->order == ORDER_ROW) {
+			ti = t / nt_j;
+			tj = t % nt_j;
+		}
+		else {
+			ti = t % nt_i;
+			tj = t / nt_i;
+		}
+		ii = ti * c->bh;
+		jj = tj * c->bw;
+		ie = (ii + c->bh < N) ? ii + c->bh : N;
+		je = (jj + c->bw < M) ? jj + c->bw : M;
+
+		if (c->split && je - jj >= 2) {
+			jm = jj + (je - jj) / 2;
+			copy_segment(c, M, N, A, B, ii, ie, jj, jm, 0, traced);
+			copy_segment(c, M, N, A, B, ii, ie, jm, je, 1, traced);
+		}
+		else
+			copy_segment(c, M, N, A, B, ii, ie, jj, je, 0, traced);
+	}
+}
+
+static void __attribute__((noinline)) kernel_traced(const struct cand *c, int M, int N, const int *A, int *B)
+{
+	kernel(c, M, N, A, B, 1);
+}
+
+static void __attribute__((noinline)) kernel_native(const struct cand *c, int M, int N, const int *A, int *B)
+{
+	kernel(c, M, N, A, B, 0);
+}
+
+/* Write the trace of the candidate and return the number of misses csim reports, or -1 */
+static int simulate(const char *csim, unsigned s, unsigned E, unsigned b,
+		    const struct cand *c, int M, int N, const int *A, int *B)
+{
+	char path[] = "/tmp/tuner.XXXXXX";
+	char cmd[512], line[256];
+	int fd, hits, misses = -1, evictions;
+	FILE *out;
+
+	if ((fd = mkstemp(path)) == -1 || (trace_fp = fdopen(fd, "w")) == NULL) {
+		perror("tuner: trace file");
+		return -1;
+	}
+	kernel_traced(c, M, N, A, B);
+	fclose(trace_fp);
+	trace_fp = NULL;
+
+	snprintf(cmd, sizeof(cmd), "%s -s %u -E %u -b %u -t %s", csim, s, E, b, path);
+	if ((out = popen(cmd, "r")) != NULL) {
+		while (fgets(line, sizeof(line), out) != NULL) {
+			if (sscanf(line, "hits:%d misses:%d evictions:%d", &hits, &misses, &evictions) == 3)
+				break;
+		}
+		pclose(out);
+	}
+	unlink(path);
+
+	return misses;
+}
+
+static long elapsed_ns(struct timespec *t0, struct timespec *t1)
+{
+	return (t1->tv_sec - t0->tv_sec) * 1000000000L + (t1->tv_nsec - t0->tv_nsec);
+}
+
+/* Time the native kernel and return ns per element, or -1 if B is not A^T */
+static double measure(const struct cand *c, int M, int N, const int *A, int *B)
+{
+	struct timespec t0, t1;
+	long reps = 0, ns;
+	int i, j;
+
+	memset(B, 0, sizeof(int) * M * N);
+	kernel_native(c, M, N, A, B);
+	for (i = 0; i < N; i++)
+		for (j = 0; j < M; j++)
+			if (A[i*M + j] != B[j*N + i])
+				return -1;
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	do {
+		kernel_native(c, M, N, A, B);
+		reps++;
+		clock_gettime(CLOCK_MONOTONIC, &t1);
+	} while ((ns = elapsed_ns(&t0, &t1)) < MINTIME_NS);
+
+	return (double)ns / reps / ((double)M * N);
+}
+
+static void print_cand(int M, int N, unsigned s, unsigned E, unsigned b, const char *what, const struct cand *c)
+{
+	printf("%d %d %u %u %u %s tile=%dx%d order=%s split=%d diag=%s misses=%d ns=%.3f\n",
+	       M, N, s, E, b, what, c->bh, c->bw, order_name[c->order], c->split,
+	       diag_name[c->diag], c->misses, c->ns);
+}
+
+/* Enumerate every candidate for one shape and print the best ones */
+static int tune(const char *csim, unsigned s, unsigned E, unsigned b, int M, int N, int verbose)
+{
+	struct cand c, best_miss, best_time;
+	int *A, *B;
+	int i, found = 0;
+
+	A = malloc(sizeof(int) * M * N);
+	B = malloc(sizeof(int) * M * N);
+	if (A == NULL || B == NULL) {
+		fprintf(stderr, "tuner: out of memory\n");
+		free(A);
+		free(B);
+		return -1;
+	}
+	for (i = 0; i < M * N; i++)
+		A[i] = i;
+
+	for (c.bh = 2; c.bh <= MAXTILE; c.bh *= 2)
+	for (c.bw = 2; c.bw <= MAXTILE; c.bw *= 2)
+	for (c.order = ORDER_ROW; c.order <= ORDER_COL; c.order++)
+	for (c.split = 0; c.split <= 1; c.split++)
+	for (c.diag = DIAG_NONE; c.diag <= DIAG_ROWBUF; c.diag++) {
+		/* Tiles larger than the matrix only repeat a smaller candidate */
+		if ((c.bh > N && c.bh / 2 >= N) || (c.bw > M && c.bw / 2 >= M))
+			continue;
+		if ((c.misses = simulate(csim, s, E, b, &c, M, N, A, B)) < 0) {
+			fprintf(stderr, "tuner: no result from %s\n", csim);
+			free(A);
+			free(B);
+			return -1;
+		}
+		if ((c.ns = measure(&c, M, N, A, B)) < 0) {
+			fprintf(stderr, "tuner: candidate %dx%d is not a transpose\n", c.bh, c.bw);
+			continue;
+		}
+		if (verbose)
+			print_cand(M, N, s, E, b, "candidate", &c);
+		if (!found || c.misses < best_miss.misses ||
+		    (c.misses == best_miss.misses && c.ns < best_miss.ns))
+			best_miss = c;
+		if (!found || c.ns < best_time.ns)
+			best_time = c;
+		found = 1;
+	}
+
+	if (found) {
+		print_cand(M, N, s, E, b, "misses", &best_miss);
+		print_cand(M, N, s, E, b, "time", &best_time);
+	}
+
+	free(A);
+	free(B);
+	return found ? 0 : -1;
+}
+
+int main(int argc, char *argv[])
+{
+	unsigned s = 5, E = 1, b = 5;
+	const char *csim = "./csim";
+	char defdims[] = "32x32,64x64,61x67";
+	char *dims = defdims;
+	char *tok;
+	int opt, verbose = 0, M, N, ret = 0;
+
+	while ((opt = getopt(argc, argv, "vs:E:b:c:d:")) != -1) {
+		switch (opt) {
+		case 'v':
+			verbose = 1;
+			break;
+		case 's':
+			s = atoi(optarg);
+			break;
+		case 'E':
+			E = atoi(optarg);
+			break;
+		case 'b':
+			b = atoi(optarg);
+			break;
+		case 'c':
+			csim = optarg;
+			break;
+		case 'd':
+			dims = optarg;
+			break;
+		default:
+			fprintf(stderr, "Usage: %s [-v] [-s <s>] [-E <E>] [-b <b>] [-c <csim>] [-d <MxN,...>]\n", argv[0]);
+			return 1;
+		}
+	}
+
+	for (tok = strtok(dims, ","); tok != NULL; tok = strtok(NULL, ",")) {
+		if (sscanf(tok, "%dx%d", &M, &N) != 2 || M <= 0 || N <= 0 || M > 256 || N > 256) {
+			fprintf(stderr, "tuner: bad shape %s (M and N must be in 1..256)\n", tok);
+			return 1;
+		}
+		if (tune(csim, s, E, b, M, N, verbose) < 0)
+			ret = 1;
+	}
+
+	return ret;
+}
@@ -3,13 +3,32 @@
  *
  * The allocator is based on segregated fits implementation.
  * With this approach, the allocator maintains head pointers for each free list.
- * The allocator partition the block sizes by powers of 2 and each free list is associated with a size class.
+ * The allocator partition the block sizes by powers of 2, and each power of 2 again into 4 sub-classes
+ * of equal width (TLSF-style), so each free list is associated with a narrow size class.
  * Each list contains potentially different-size blocks whose sizes are members of the size class.
  *
+ * The non-empty lists are tracked with a two-level bitmap: one bit per power of 2 (first level)
+ * and, for each power of 2, one bit per sub-class (second level). A request is rounded up to the
+ * next class boundary, so every block in the first non-empty class at or above it fits, and that class
+ * is found with two find-first-set operations instead of walking the lists.
+ *
  * In addition, each free list is organized as explicit list.
  * Each free block has its own boundary tags(i.e. header and footer), and pred/succ pointer.
  * Using the pred and succ pointers, the heap is organized as a doubly linked free list.
- * Also, the allocator maintain the lists in address order (not LIFO).
+ * Headers, footers and pointers are all 4-byte words on 32-bit and 64-bit machines alike: a pointer is
+ * stored as its offset from the start of the heap (0 for NULL), so a free block needs only 16 bytes and
+ * blocks are multiples of 16 bytes with 16-byte aligned payloads, as SSE/AVX loads and glibc expect.
+ * Also, the allocator maintain the lists in address order (not LIFO) by default. Since that costs
+ * a list walk on every free, INSERT_POLICY can select LIFO insertion or address order bounded to
+ * the first INSERT_SCAN blocks of the list at build time. Likewise FIT_POLICY selects how a free block is
+ * picked: the head of the next larger class (default), or best fit, good fit (the best of the first
+ * FIT_SCAN blocks) or next fit (from a roving pointer per class) in the class of the size first.
+ *
+ * Built with QUICKLISTS, freed blocks of at most QL_MAXSIZE bytes are not coalesced right away. They stay
+ * marked allocated and are pushed on a quick list of their exact size, from which a request of the same
+ * block size pops them again. A quick list is coalesced into the free lists as a batch when it grows beyond
+ * QL_LIMIT blocks, and all of them are before a request of QL_CONSOLIDATE bytes or more is searched for,
+ * and when no free block fits, before the heap is extended.
  *
  * To handle the edge condition, the allocator maintain its prologue and epilogue blocks that are
  * always marked as allocated. Especially, epilogue block has zero size.
@@ -32,40 +51,116 @@
  * -------------------------------------------------------
  *
  * Form of header
- * 31					  3   2   1   0
- * ------------------------------------------------------
- * |					    |	|   |   |
- * ------------------------------------------------------
- *  <--------------------------------------->
- *  			size			<--->
+ * 31					  4   3   2   1   0
+ * ----------------------------------------------------------
+ * |					|   |	|   |   |
+ * ----------------------------------------------------------
+ *  <----------------------------------->
+ *  			size		    <--->
+ *  				    grown by mm_realloc bit
+ *  					    <--->
  *  				allocated/free bit of the previous block
  *  						    <--->
  *  					allocated/free bit of the current block
  * Form of footer
- * 31					  3   2   1   0
- * ------------------------------------------------------
- * |					    |	|   |   |
- * ------------------------------------------------------
- *  <------------------------------------------->
- *  			size			    <--->
+ * 31					  4   3   2   1   0
+ * ----------------------------------------------------------
+ * |					|   |	|   |   |
+ * ----------------------------------------------------------
+ *  <----------------------------------->
+ *  			size				<--->
  *  				allocated/free bit of the current block
  *
+ * Built with SLAB, requests of at most SLAB_MAXSIZE bytes don't get blocks of their own. Objects of
+ * the same size class are packed into runs: allocated blocks of RUNSIZE bytes whose payload starts a page
+ * (aligned to RUNSIZE from the start of the heap) and holds a run header and equal-size objects without
+ * any header. The free objects of a run are tracked by a bitmap in the run header, and each class keeps
+ * a list of its runs with free objects. One bit per page of the heap marks the pages that start a run,
+ * so mm_free finds out whether a pointer is an object and which run it belongs to by masking it.
+ *
+ * Struct of a run
+ * -------------------------------------------------------
+ * |	    |	   		|			 |
+ * | header | run header	| object | object | . . .	 |
+ * |	    | (links, bitmap)	|			 |
+ * -------------------------------------------------------
+ *	    ^ RUNSIZE aligned
+ *
+ * When no free block fits, the heap grows by the larger of the request and a growth chunk. The chunk is
+ * the larger of grow_chunk, which doubles when the heap was extended less than GROW_WINDOW requests ago
+ * and halves otherwise, and 1/2^grow_shift of the heap size. It is kept between grow_min and grow_max,
+ * which mm_set_growth can change before mm_init, so allocation-heavy phases need few mem_sbrk calls.
+ *
+ * mm_malloc_batch carves the blocks of a batch in a row out of one found free block, so a batch costs one
+ * search and one split instead of one each per block. mm_free_batch sorts the pointers by address and frees
+ * every row of adjacent blocks as one block, so a row costs one coalesce and one free list insertion.
+ *
+ * Built with MMAP_LARGE, requests of mmap_threshold bytes or more are not placed in the heap at all.
+ * Each of them gets a mapping of its own, holding a header like a heap block, which is unmapped by mm_free.
+ * The padding in front of the header keeps the offset of the payload in the mapping, so mm_memalign maps
+ * its large requests too, with the payload at an offset of the alignment.
+ * Built with RELEASE_FREE, the pages inside a block freed into a free block of TRIM_THRESHOLD bytes or
+ * more are given back to the OS with MADV_DONTNEED. memlib can't lower the break, so this is also how the
+ * free block at the top of the heap is trimmed.
+ *
+ * Built with ARENAS, mm.c manages up to MAXARENAS such heaps (arenas). Arena 0 is the heap of memlib,
+ * the others are carved from their own mapped regions of ARENASIZE bytes. first_listp and head_ptr
+ * are then per thread and point into the arena the thread has entered under the arena's lock.
+ * A block freed by a thread that is bound to another arena is not freed right away; it is pushed
+ * on the remote-free list of its owner arena without any lock, and the owner frees it the next
+ * time it enters the arena.
+ *
+ * Built with MM_STATS, mm.c counts the calls per size class, the free blocks find_fit looks at, the
+ * coalesce cases and the heap extensions, and mm_get_stats adds up the heap by walking it. Built with
+ * MM_TRACE, every mm_malloc, mm_free and mm_realloc is logged as a binary record to the file given to
+ * mm_trace_open. Both hook only the public functions, so the calls mm.c makes internally are not counted.
+ *
+ * Built with HEAPCHECK, every operation checks the next CHECK_SLICE blocks of the heap, resuming at a cursor
+ * kept in the heap metadata, and every CHECK_PERIOD operations mm_check checks the whole heap in linear time.
+ * The checker aborts on the first inconsistency it finds.
+ *
  * Struct of the heap
  *
- * -------------------------------------------------------------------------
- * |     Free list	|	   |				|	   |
- * |    headers for	| prologue | 	blocks . . . 		| epilogue |
- * |  each size class	|	   |				|	   |
- * -------------------------------------------------------------------------
+ * ---------------------------------------------------------------------------------------
+ * |     Free list	|  first/second	| run list heads|	   |			|	   |
+ * |    headers for	|  level class	| and page map	| prologue | blocks . . . 	| epilogue |
+ * |  each size class	|    bitmaps	|    (SLAB)	|	   |			|	   |
+ * ---------------------------------------------------------------------------------------
  *
  */
+
+/* Build options, before the includes they depend on */
+//#define HEAPCHECK
+//#define ARENAS
+//#define SLAB
+//#define MMAP_LARGE	/* The lab driver requires every block to be inside the heap */
+//#define RELEASE_FREE
+//#define QUICKLISTS
+//#define MM_STATS
+//#define MM_TRACE
+
+#ifdef MMAP_LARGE
+#define _GNU_SOURCE	/* mremap */
+#endif
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <assert.h>
 #include <unistd.h>
 #include <string.h>
+#ifdef ARENAS
+#include <pthread.h>
+#endif
+#if defined(ARENAS) || defined(MMAP_LARGE) || defined(RELEASE_FREE) || defined(HEAPCHECK)
+#include <sys/mman.h>
+#endif
+#ifdef MM_TRACE
+#include <fcntl.h>
+#include <time.h>
+#endif
 
 #include "mm.h"
+#include "mm_ext.h"
 #include "memlib.h"
 
 /*********************************************************
@@ -85,20 +180,72 @@ team_t team = {
     ""
 };
 
-//#define HEAPCHECK
+/* Free list insertion policies */
+#define INSERT_ADDRESS	0	/* Address order: O(n) per free, lowest fragmentation */
+#define INSERT_LIFO	1	/* Head of the list: O(1) per free */
+#define INSERT_BOUNDED	2	/* Address order among the first INSERT_SCAN blocks: O(INSERT_SCAN) per free */
+
+#ifndef INSERT_POLICY
+#define INSERT_POLICY INSERT_ADDRESS
+#endif
+#define INSERT_SCAN 8
+
+/* Placement policies */
+#define FIT_FIRST	0	/* Head of the next larger class through the bitmaps, else first fit in the class of the size */
+#define FIT_BEST	1	/* Smallest fitting block of the class of the size, else of the next non-empty class: O(n) */
+#define FIT_GOOD	2	/* As FIT_BEST, but stop at a fit once FIT_SCAN blocks were looked at: O(FIT_SCAN) mostly */
+#define FIT_NEXT	3	/* First fit from a roving pointer of the class, which stays behind the block taken */
+
+#ifndef FIT_POLICY
+#define FIT_POLICY FIT_FIRST
+#endif
+#define FIT_SCAN 8
+#define ALIGN_SCAN 128	/* Blocks looked at for an aligned fit before allocating with room for the alignment */
+
+/* Variables for the quick lists */
+#define QL_MAXSIZE 256				/* Largest block size kept in a quick list (bytes) */
+#define QL_NUMCLASS (QL_MAXSIZE/ALIGNMENT)	/* One quick list per block size */
+#define QL_LIMIT 32				/* A quick list is coalesced when it would get more blocks */
+#define QL_CONSOLIDATE 1024			/* Requests of this block size coalesce every quick list first */
 
 /* Basic constants and macros */
 #define WSIZE 4			/* Word and header/footer size (bytes) */
 #define DSIZE 8			/* Double word size (bytes) */
-#define ALIGNMENT 8		/* Double word alignment */	
-#define CHUNKSIZE (1<<8)	/* Extend heap by this amount (bytes) */
+#define ALIGNMENT 16		/* Payload alignment (bytes) */
+#define MINBLOCKSIZE 16		/* Header, pred, succ and footer of a free block (bytes) */
+#define CHUNKSIZE (1<<8)	/* Extend heap by at least this amount (bytes) */
+#define GROW_MAX (1<<16)	/* Default upper bound of a heap extension beyond the request (bytes) */
+#define GROW_SHIFT 4		/* Default: extend by at least 1/2^GROW_SHIFT of the heap size */
+#define GROW_WINDOW 64		/* Extensions less than this many requests apart double the growth chunk */
+#define REALLOC_SLACK 2		/* Growth steps reserved for a block mm_realloc grew before */
+#ifndef HEAP_MAXSIZE
+#define HEAP_MAXSIZE (20*(1<<20))	/* Largest heap (bytes), as MAX_HEAP of memlib */
+#endif
+#define PAGESIZE (1<<12)
+#define MAXREQUEST (0xffffffffUL - (1<<16))	/* Largest request whose block or mapping size fits in a header (bytes) */
+#define MMAP_THRESHOLD (128*(1<<10))	/* Default size of the requests mapped separately with MMAP_LARGE (bytes) */
+#define TRIM_THRESHOLD (128*(1<<10))	/* Free blocks from this size give their pages back with RELEASE_FREE (bytes) */
+#define CHECK_SLICE 16			/* Blocks checked per operation with HEAPCHECK */
+#define CHECK_PERIOD (1<<12)		/* Operations between two checks of the whole heap with HEAPCHECK (0: never) */
 
 /* Variables for size classes */
-#define NUMOFCLASS 14		/* Number of size classes */
 #define LARGESTPOWEROFTWO 18	
-#define SMALLESTPOWEROFTWO (LARGESTPOWEROFTWO - NUMOFCLASS + 2)
-#define LARGESTSIZE (1 << LARGESTPOWEROFTWO)		/* The last class has size [(LARGESTSIZE+1) ~ infinity] */ 
-#define SMALLESTSIZE (1 << SMALLESTPOWEROFTWO)		/* The first class has size [1 ~ SMALLESTSIZE] */
+#define SMALLESTPOWEROFTWO 6
+#define SUBCLASSBITS 2					/* Each power of two is split into 2^SUBCLASSBITS classes */
+#define NUMOFSUBCLASS (1 << SUBCLASSBITS)
+#define NUMOFCLASS ((LARGESTPOWEROFTWO - SMALLESTPOWEROFTWO + 1)*NUMOFSUBCLASS + 1)	/* Number of size classes */
+#define NUMOFGROUP ((NUMOFCLASS + NUMOFSUBCLASS - 1) >> SUBCLASSBITS)			/* Number of first level entries */
+#define LISTSIZE ((NUMOFCLASS + 1 + NUMOFGROUP)*WSIZE)		/* Free list headers and bitmaps */
+#define LARGESTSIZE (1 << LARGESTPOWEROFTWO)		/* The last class has size [LARGESTSIZE ~ infinity] */ 
+#define SMALLESTSIZE (1 << SMALLESTPOWEROFTWO)		/* Sizes below it are split linearly into NUMOFSUBCLASS classes */
+
+/* Index of the most significant / least significant set bit of x (x > 0) */
+#define FLS(x)	((int)(sizeof(unsigned long)*8 - 1) - __builtin_clzl((unsigned long)(x)))
+#define FFS(x)	__builtin_ctzl((unsigned long)(x))
+
+/* Address of the first level bitmap and of the second level bitmap of a first level entry */
+#define FL_BITMAPP		(first_listp + NUMOFCLASS*WSIZE)
+#define SL_BITMAPP(fl)		(first_listp + (NUMOFCLASS + 1 + (fl))*WSIZE)
 
 /* Pack a size, previous allocated bit, and current allocated bit into a word for header */
 #define PACK_HDR(size, prev_alloc, alloc) 	((size) | (prev_alloc << 1) | (alloc))
@@ -106,17 +253,20 @@ team_t team = {
 #define PACK_FTR(size, alloc)  ((size) | (alloc))
 
 /* Read and write a word at address p */
-#define GET(p)		(*(size_t *)(p))
-#define PUT(p, val)	((*(size_t *)(p)) = (val))
+#define GET(p)		(*(unsigned int *)(p))
+#define PUT(p, val)	((*(unsigned int *)(p)) = (val))
 
-/* Read and write a pointer at address p */
-#define GET_PTR(p)	((char *)(*(size_t *)(p)))
-#define PUT_PTR(p, val)	((*(size_t *)(p)) = (size_t)(val))
+/* Read and write a pointer at address p, stored as an offset from the start of the heap */
+#define GET_PTR(p)	(GET(p) ? first_listp + GET(p) : NULL)
+#define PUT_PTR(p, val)	PUT(p, (val) ? (unsigned int)((char *)(val) - first_listp) : 0)
 
 /* Read the size and allocated fields from address p */
-#define GET_SIZE(p)	(GET(p) & ~0x7)
+#define GET_SIZE(p)	(GET(p) & ~0xF)
 #define GET_ALLOC(p)	(GET(p) & 0x1)
 
+/* Read the grown by mm_realloc bit from address p */
+#define GET_GROWN(p)		((GET(p) & 0x8) >> 3)
+
 /* Read and write a previous allocated bit at address p */
 #define GET_PREV_ALLOC(p)	(((GET(p) & 0x2)) >> 1)
 #define PUT_PREV_ALLOC(p, val)	PUT(p, ((GET(p) & ~0x2) | (val << 1)))
@@ -138,238 +288,1655 @@ team_t team = {
 #define SUCCPOFPRED(ptr)	SUCCP(GET_PTR(PREDP(ptr)))
 
 /* rounds up to the nearest multiple of ALIGNMENT */
-#define ALIGN(size) (((size) + (ALIGNMENT-1)) & ~0x7)
+#define ALIGN(size) (((size) + (ALIGNMENT-1)) & ~(size_t)(ALIGNMENT-1))
+
+#ifdef SLAB
+/* Variables for the runs */
+#define RUNSHIFT 12
+#define RUNSIZE (1 << RUNSHIFT)				/* Size of a run including its block header (bytes) */
+#define SLAB_STEP 16					/* Width of a run size class (bytes), keeps objects aligned */
+#define SLAB_NUMCLASS 4					/* Number of run size classes */
+#define SLAB_MAXSIZE (SLAB_STEP*SLAB_NUMCLASS)		/* Largest request served by the runs */
+#define RUN_MAPWORDS ((RUNSIZE/SLAB_STEP + 31) / 32)	/* Words of the free object bitmap of a run */
+#define NUMOFPAGE (HEAP_MAXSIZE >> RUNSHIFT)
+#define SLABSIZE (ALIGN(SLAB_NUMCLASS*WSIZE + NUMOFPAGE/8))	/* Run list heads and page map */
+
+/* Address of the head of the run list of a class, and of the page map */
+#define RUN_HEADP(class)	(first_listp + LISTSIZE + (class)*WSIZE)
+#define PAGE_MAPP		((unsigned int *)(first_listp + LISTSIZE + SLAB_NUMCLASS*WSIZE))
+
+/* Given a pointer into the heap, compute the index of its page, whether the page starts a run, and the run */
+#define PAGE_INDEX(ptr)		(((char *)(ptr) - first_listp) >> RUNSHIFT)
+#define IS_RUN(ptr)		((PAGE_MAPP[PAGE_INDEX(ptr) >> 5] >> (PAGE_INDEX(ptr) & 31)) & 1)
+#define RUNP(ptr)		((struct run *)(first_listp + (PAGE_INDEX(ptr) << RUNSHIFT)))
+
+/* Given a run, compute the address of its first object */
+#define OBJP(run)		((char *)(run) + ALIGN(sizeof(struct run)))
+
+/* Structure for a run header */
+struct run {
+    struct run *pred, *succ;		/* Links of the run list of the class */
+    unsigned short objsize, class;
+    unsigned short numobj, numfree;
+    unsigned int map[RUN_MAPWORDS];	/* Bit set: the object is free */
+};
+#else
+#define SLABSIZE 0
+#endif
+
+/* Round up and down to a page boundary */
+#define PAGE_UP(ptr)	((char *)(((size_t)(ptr) + PAGESIZE - 1) & ~(size_t)(PAGESIZE - 1)))
+#define PAGE_DOWN(ptr)	((char *)((size_t)(ptr) & ~(size_t)(PAGESIZE - 1)))
+
+#ifdef HEAPCHECK
+/* Address of the block the incremental check resumes at, and of the operation count */
+#define CHECK_CURSORP		(first_listp + LISTSIZE + SLABSIZE)
+#define CHECK_COUNTP		(first_listp + LISTSIZE + SLABSIZE + WSIZE)
+#define CHECKSIZE (2*WSIZE)
+#define CHECK_MAPSIZE (HEAP_MAXSIZE/ALIGNMENT/8)	/* Free list membership bitmap of mm_check (bytes) */
+
+/* The block ptr was merged into the block into: move the cursor off it */
+#define CHECK_MERGED(ptr, into)	do { if (GET_PTR(CHECK_CURSORP) == (char *)(ptr)) PUT_PTR(CHECK_CURSORP, into); } while (0)
+#else
+#define CHECKSIZE 0
+#define CHECK_MERGED(ptr, into)
+#endif
+
+#if FIT_POLICY == FIT_NEXT
+/* Address of the roving pointer of a class */
+#define ROVERP(index)		(first_listp + LISTSIZE + SLABSIZE + CHECKSIZE + (index)*WSIZE)
+#define ROVERSIZE (NUMOFCLASS*WSIZE)
+#else
+#define ROVERSIZE 0
+#endif
 
-#define SIZE_T_SIZE (ALIGN(sizeof(size_t)))
+#ifdef QUICKLISTS
+/* Address of the head and of the block count of the quick list for a block size */
+#define QL_INDEX(size)		((size)/ALIGNMENT - 1)
+#define QL_HEADP(index)		(first_listp + LISTSIZE + SLABSIZE + CHECKSIZE + ROVERSIZE + (index)*WSIZE)
+#define QL_COUNTP(index)	(first_listp + LISTSIZE + SLABSIZE + CHECKSIZE + ROVERSIZE + (QL_NUMCLASS + (index))*WSIZE)
+#define QLSIZE (2*QL_NUMCLASS*WSIZE)
+#else
+#define QLSIZE 0
+#endif
+
+/* Heap metadata in front of the prologue, and the offset of the first payload behind the prologue and epilogue */
+#define METASIZE (LISTSIZE + SLABSIZE + CHECKSIZE + ROVERSIZE + QLSIZE)
+#define HEAPSTART (ALIGN(METASIZE + 2*WSIZE))
+
+#ifdef ARENAS
+#define MAXARENAS 64
+#define ARENASIZE HEAP_MAXSIZE	/* Size of the region reserved for each arena except arena 0 (bytes) */
+#define ARENA_LOCAL __thread
+#else
+#define ARENA_LOCAL
+#endif
 
 /* Points to the appropriate haeder pointer for the current block size */
-static char *head_ptr = 0;
+static ARENA_LOCAL char *head_ptr = 0;
 
 /* Always points to the first entry of the free lists */
-static char *first_listp = 0;
+static ARENA_LOCAL char *first_listp = 0;
+
+/* Bounds of the growth chunk and the heap size fraction, set by mm_set_growth */
+static size_t grow_min = CHUNKSIZE;
+static size_t grow_max = GROW_MAX;
+static int grow_shift = GROW_SHIFT;
+
+/* Current growth chunk, and the number of requests since the heap was last extended */
+static ARENA_LOCAL size_t grow_chunk = CHUNKSIZE;
+static ARENA_LOCAL unsigned int grow_since = 0;
+
+#ifdef MMAP_LARGE
+/* Requests of this size or more are mapped separately */
+static size_t mmap_threshold = MMAP_THRESHOLD;
+
+/* Word in the padding of a mapped block: the offset of the payload from the start of the mapping */
+#define MAP_OFFP(ptr)	((char *)(ptr) - DSIZE)
+#define MAP_START(ptr)	((char *)(ptr) - GET(MAP_OFFP(ptr)))
+
+/* Total length of the mappings */
+static size_t mapped_bytes = 0;
+#ifdef ARENAS
+#define MAPPED_ADD(n)	__atomic_fetch_add(&mapped_bytes, (n), __ATOMIC_RELAXED)
+#define MAPPED_SUB(n)	__atomic_fetch_sub(&mapped_bytes, (n), __ATOMIC_RELAXED)
+#else
+#define MAPPED_ADD(n)	(mapped_bytes += (n))
+#define MAPPED_SUB(n)	(mapped_bytes -= (n))
+#endif
+
+static int in_heap(void *ptr);
+static void *mmap_malloc(size_t size, size_t align);
+static void *mmap_realloc(void *ptr, size_t size);
+#endif
+
+#ifdef ARENAS
+/* Structure for an arena */
+struct arena {
+    char *listp;		/* first_listp of the arena */
+    char *lo, *brk, *max;	/* Region and break of the arena (unused for arena 0) */
+    pthread_mutex_t lock;
+    void *remote;		/* Blocks freed by threads of other arenas, linked through the payload */
+};
+
+static struct arena arenas[MAXARENAS];
+static int numofarena = 0;
+
+/* The arena the calling thread has entered */
+static ARENA_LOCAL struct arena *cur_arena = 0;
+
+static void enter_arena(struct arena *arena);
+static void leave_arena(struct arena *arena);
+#endif
+
+#ifdef MM_STATS
+_Static_assert(NUMOFCLASS == MM_NUMCLASS, "MM_NUMCLASS of mm_ext.h must match NUMOFCLASS");
+
+/* Counters of mm_get_stats. The arenas update them concurrently, with relaxed atomic adds */
+static struct mm_stats stats;
+
+#ifdef ARENAS
+#define STAT_ADD(field, n)	__atomic_fetch_add(&stats.field, (n), __ATOMIC_RELAXED)
+#define STAT_SUB(field, n)	__atomic_fetch_sub(&stats.field, (n), __ATOMIC_RELAXED)
+#else
+#define STAT_ADD(field, n)	(stats.field += (n))
+#define STAT_SUB(field, n)	(stats.field -= (n))
+#endif
+
+static void walk_heap(struct mm_stats *st);
+#else
+#define STAT_ADD(field, n)
+#define STAT_SUB(field, n)
+#endif
+
+#ifdef MM_TRACE
+#define TRACE_BUFEVENTS 256	/* Events buffered before they are written out */
+
+/* Trace file, and the events of this thread not written yet */
+static int trace_fd = -1;
+static ARENA_LOCAL struct mm_trace_event trace_buf[TRACE_BUFEVENTS];
+static ARENA_LOCAL int trace_len = 0;
+
+#ifdef ARENAS
+/* The threads that buffered events, so mm_trace_close writes out every buffer. A thread leaves the list
+ * when it exits, writing out its own events. */
+struct trace_thread {
+    struct mm_trace_event *buf;
+    int *len;
+    struct trace_thread *next;
+};
+static ARENA_LOCAL struct trace_thread trace_self;
+static struct trace_thread *trace_threads = NULL;
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t trace_once = PTHREAD_ONCE_INIT;
+static pthread_key_t trace_key;
+
+static void trace_register(void);
+static void trace_key_create(void);
+static void trace_exit(void *arg);
+#endif
+
+static void trace(unsigned int op, void *ptr, void *oldptr, size_t size);
+static void trace_write(struct mm_trace_event *buf, int *len);
+#define TRACE(op, ptr, oldptr, size)	trace(op, ptr, oldptr, size)
+#else
+#define TRACE(op, ptr, oldptr, size)
+#endif
+
+static void *malloc_block(size_t size);
+static void free_block(void *ptr);
+static void *realloc_block(void *ptr, size_t size);
 
 static void *extend_heap(size_t words);
 static void place(void *ptr, size_t newsize);
 static void *find_fit(size_t newsize);
+#if FIT_POLICY != FIT_FIRST
+static void *scan_class(int index, size_t newsize);
+#endif
 static void *coalesce(void *ptr);
 static void insert_block(void *predptr, void *ptr);
 static void remove_block(void *ptr);
 static void *split_block(void *ptr, size_t fsize, size_t lsize);
+static void trim_block(void *ptr, size_t newsize);
 static void *get_listp(size_t size);
+static int get_index(size_t size);
+static int find_class(int index);
+
+static void *heap_sbrk(int incr);
+static size_t grow_size(size_t size);
+static int init_heap(void);
+
+static void *alloc_aligned(size_t newsize, size_t align, char *base);
+static void *find_aligned_fit(size_t newsize, size_t align, char *base);
+static size_t aligned_lead(char *ptr, size_t align, char *base);
+static int heap_block(void *ptr);
+static void sort_ptrs(void **ptrs, size_t n);
+static void sift_ptrs(void **ptrs, size_t root, size_t n);
+
+#ifdef QUICKLISTS
+static void ql_push(void *ptr, size_t size);
+static void *ql_pop(int index);
+static int ql_flush(int index);
+static int ql_flush_all(void);
+#endif
+
+#ifdef SLAB
+static void *slab_malloc(size_t size);
+static void slab_free(void *ptr);
+static struct run *new_run(int class);
+#endif
 
+#ifdef HEAPCHECK
 static int mm_check(void);
+static void check_step(void);
+static int check_block(void *ptr);
+
+/* Scratch bitmap of mm_check, one bit per ALIGNMENT bytes of the heap */
+static ARENA_LOCAL unsigned int *check_map = 0;
+
+#ifdef ARENAS
+/* Each thread maps its own bitmap, unmapped when the thread exits */
+static pthread_once_t check_once = PTHREAD_ONCE_INIT;
+static pthread_key_t check_key;
+
+static void check_key_create(void);
+static void check_exit(void *arg);
+#endif
+#endif
 
 /* 
  * mm_init - initialize the malloc package.
  */
 int mm_init(void)
+{
+#ifdef ARENAS
+    numofarena = 1;
+    cur_arena = &arenas[0];
+    cur_arena->remote = NULL;
+    pthread_mutex_init(&cur_arena->lock, NULL);
+    if (init_heap() == -1)
+	return -1;
+    cur_arena->listp = first_listp;
+    return 0;
+#else
+    return init_heap();
+#endif
+}
+
+/*
+ * init_heap - Create the free list headers, the prologue and epilogue blocks,
+ * 	       and the first free block of the current heap.
+ */
+static int init_heap(void)
 {
     /* Create the initial empty heap */
-    if ((first_listp = mem_sbrk((NUMOFCLASS + 2)*WSIZE)) == (void *)-1)
+    if ((first_listp = heap_sbrk(HEAPSTART)) == (void *)-1)
 	return -1;
 
-    /* Initialize every free list entry */
+    /* Initialize every free list entry and the bitmaps */
     for (int i = 0; i < NUMOFCLASS; i++) {
         PUT_PTR(first_listp + (i*WSIZE), NULL);
     }
+    PUT(FL_BITMAPP, 0);
+    for (int i = 0; i < NUMOFGROUP; i++) {
+        PUT(SL_BITMAPP(i), 0);
+    }
+#ifdef SLAB
+    for (int i = 0; i < SLAB_NUMCLASS; i++) {
+        PUT_PTR(RUN_HEADP(i), NULL);
+    }
+    memset(PAGE_MAPP, 0, NUMOFPAGE/8);
+#endif
+#ifdef HEAPCHECK
+    PUT_PTR(CHECK_CURSORP, NULL);
+    PUT(CHECK_COUNTP, 0);
+#endif
+#if FIT_POLICY == FIT_NEXT
+    for (int i = 0; i < NUMOFCLASS; i++) {
+        PUT_PTR(ROVERP(i), NULL);
+    }
+#endif
+#ifdef QUICKLISTS
+    for (int i = 0; i < QL_NUMCLASS; i++) {
+        PUT_PTR(QL_HEADP(i), NULL);
+        PUT(QL_COUNTP(i), 0);
+    }
+#endif
 
     /* Initialize each header for Prologue and Epilogue block */
-    PUT(first_listp + ((NUMOFCLASS)*WSIZE), PACK_HDR(DSIZE, 1, 1));	/* Prologue header */
-    PUT(first_listp + ((NUMOFCLASS + 1)*WSIZE), PACK_HDR(0, 1, 1));	/* Epilogue header */
+    PUT(first_listp + HEAPSTART - 2*WSIZE, PACK_HDR(0, 1, 1));	/* Prologue header */
+    PUT(first_listp + HEAPSTART - WSIZE, PACK_HDR(0, 1, 1));		/* Epilogue header */
 
-    /* Extend the empty heap with a free block of CHUNKSIZE bytes */
-    if (extend_heap(CHUNKSIZE/WSIZE) == NULL)
+    /* Extend the empty heap with a free block of grow_min bytes */
+    grow_chunk = grow_min;
+    if (extend_heap(grow_min/WSIZE) == NULL)
 	return -1;
 
     return 0;
 }
 /*
- * mm_malloc - Allocate a block which has payload of at least given size bytes and return the pointer
+ * mm_malloc - Allocate a block which has payload of at least given size bytes and return the pointer
+ */
+void *mm_malloc(size_t size)
+{
+    void *ptr = malloc_block(size);
+
+    STAT_ADD(malloc_calls, 1);
+    STAT_ADD(class_allocs[get_index(ALIGN(size + WSIZE))], 1);
+    TRACE(MM_TRACE_MALLOC, ptr, NULL, size);
+
+    return ptr;
+}
+
+/*
+ * mm_free - Free the block pointed to by ptr.
+ */
+void mm_free(void *ptr)
+{
+    STAT_ADD(free_calls, 1);
+    STAT_ADD(class_frees[get_index(mm_usable_size(ptr) + WSIZE)], 1);
+    TRACE(MM_TRACE_FREE, ptr, NULL, 0);
+
+    free_block(ptr);
+}
+
+/*
+ * mm_malloc_batch - Allocate n blocks which have payload of at least given size bytes each into out.
+ * 		     Return how many were allocated, which is less than n only when out of memory.
+ */
+size_t mm_malloc_batch(size_t size, size_t n, void **out)
+{
+    size_t count = 0;
+    size_t newsize, rowsize, prev_alloc, k, i;
+    char *ptr;
+
+    if (size == 0 || size > MAXREQUEST)
+	return 0;
+
+#if defined(MMAP_LARGE) || defined(SLAB)
+    /* Blocks of their own mappings or of runs are not carved from the heap */
+    if (
+#ifdef MMAP_LARGE
+	size >= mmap_threshold ||
+#endif
+#ifdef SLAB
+	size <= SLAB_MAXSIZE ||
+#endif
+	0) {
+	while (count < n && (out[count] = mm_malloc(size)) != NULL)
+	    count++;
+	return count;
+    }
+#endif
+
+    grow_since++;
+    newsize = ALIGN(size + WSIZE);
+
+#ifdef QUICKLISTS
+    /* Recently freed blocks of this size first */
+    if (newsize <= QL_MAXSIZE)
+	while (count < n && (out[count] = ql_pop(QL_INDEX(newsize))) != NULL)
+	    count++;
+    if (newsize >= QL_CONSOLIDATE)
+	ql_flush_all();
+#endif
+
+    while (count < n) {
+	/* As many blocks as a free block holds, or the whole rest of the batch */
+	k = ((HEAP_MAXSIZE < MAXREQUEST) ? HEAP_MAXSIZE : MAXREQUEST) / newsize;
+	k = (k == 0) ? 1 : (k < n - count) ? k : n - count;
+	if ((ptr = find_fit(k * newsize)) == NULL && (ptr = find_fit(newsize)) == NULL) {
+#ifdef QUICKLISTS
+	    if (ql_flush_all() > 0)
+		continue;
+#endif
+	    if ((ptr = extend_heap(grow_size(k * newsize)/WSIZE)) == NULL &&
+		(ptr = extend_heap(grow_size(newsize)/WSIZE)) == NULL)
+		break;
+	}
+	if (GET_SIZE(HDRP(ptr)) < k * newsize)
+	    k = GET_SIZE(HDRP(ptr)) / newsize;
+	place(ptr, k * newsize);
+
+	/* Split the row into blocks. The last one keeps what place left over */
+	rowsize = GET_SIZE(HDRP(ptr));
+	prev_alloc = GET_PREV_ALLOC(HDRP(ptr));
+	for (i = 0; i < k - 1; i++) {
+	    PUT(HDRP(ptr), PACK_HDR(newsize, prev_alloc, 1));
+	    out[count++] = ptr;
+	    ptr += newsize;
+	    prev_alloc = 1;
+	}
+	PUT(HDRP(ptr), PACK_HDR(rowsize - (k - 1) * newsize, prev_alloc, 1));
+	out[count++] = ptr;
+#ifdef HEAPCHECK
+	check_step();
+#endif
+    }
+
+    STAT_ADD(malloc_calls, count);
+    STAT_ADD(class_allocs[get_index(newsize)], count);
+#ifdef MM_TRACE
+    for (i = 0; i < count; i++)
+	TRACE(MM_TRACE_MALLOC, out[i], NULL, size);
+#endif
+
+    return count;
+}
+
+/*
+ * mm_free_batch - Free the n blocks pointed to by ptrs. NULL pointers are skipped, and ptrs is sorted.
+ */
+void mm_free_batch(void **ptrs, size_t n)
+{
+    size_t i, j, size;
+    char *ptr;
+
+    for (i = 0; i < n; i++) {
+	if (ptrs[i] == NULL)
+	    continue;
+	STAT_ADD(free_calls, 1);
+	STAT_ADD(class_frees[get_index(mm_usable_size(ptrs[i]) + WSIZE)], 1);
+	TRACE(MM_TRACE_FREE, ptrs[i], NULL, 0);
+    }
+
+    sort_ptrs(ptrs, n);
+
+    for (i = 0; i < n; i = j) {
+	ptr = ptrs[i];
+	j = i + 1;
+	if (ptr == NULL)
+	    continue;
+
+	/* Merge the blocks that follow it into it while they are freed too */
+	if (heap_block(ptr)) {
+	    size = GET_SIZE(HDRP(ptr));
+	    while (j < n && ptrs[j] == ptr + size && heap_block(ptrs[j])) {
+		CHECK_MERGED(ptrs[j], ptr);
+		size += GET_SIZE(HDRP(ptrs[j]));
+		j++;
+	    }
+	    PUT(HDRP(ptr), PACK_HDR(size, GET_PREV_ALLOC(HDRP(ptr)), 1));
+	}
+	free_block(ptr);
+    }
+}
+
+/*
+ * mm_realloc - Resize the block pointed to by ptr to at least given size bytes of payload
+ */
+void *mm_realloc(void *ptr, size_t size)
+{
+    void *newptr = realloc_block(ptr, size);
+
+    STAT_ADD(realloc_calls, 1);
+    TRACE(MM_TRACE_REALLOC, newptr, ptr, size);
+
+    return newptr;
+}
+
+/*
+ * malloc_block - mm_malloc without the statistics and the trace
+ */
+static void *malloc_block(size_t size)
+{
+    size_t newsize;
+    size_t extendsize;
+    char *ptr;
+
+    /* Ignore spurious requests, and ones too large for the header */
+    if (size == 0 || size > MAXREQUEST)
+	return NULL;
+
+    grow_since++;
+
+#ifdef MMAP_LARGE
+    if (size >= mmap_threshold)
+	return mmap_malloc(size, ALIGNMENT);
+#endif
+
+#ifdef SLAB
+    /* Tiny requests are served from the runs of their size class */
+    if (size <= SLAB_MAXSIZE)
+	return slab_malloc(size);
+#endif
+
+    /* Caculate the new block size which include overhead and alignment.
+     * It is at least MINBLOCKSIZE, so there is room for the pointers once it is freed */
+    newsize = ALIGN(size + WSIZE);
+
+#ifdef QUICKLISTS
+    /* A block of this size freed recently is taken as it is */
+    if (newsize <= QL_MAXSIZE && (ptr = ql_pop(QL_INDEX(newsize))) != NULL) {
+#ifdef HEAPCHECK
+	check_step();
+#endif
+	return ptr;
+    }
+#endif
+
+    /* Search the free list for a fit. Coalesce the quick lists and search again before extending the heap */
+#ifdef QUICKLISTS
+    if (newsize >= QL_CONSOLIDATE)
+	ql_flush_all();
+#endif
+    ptr = find_fit(newsize);
+#ifdef QUICKLISTS
+    if (ptr == NULL && ql_flush_all() > 0)
+	ptr = find_fit(newsize);
+#endif
+    if (ptr != NULL) {
+	place(ptr, newsize);
+#ifdef HEAPCHECK
+	check_step();
+#endif
+	return ptr;
+    }
+
+    /* No fit found. Get more memory and place the block, growing by the block size alone near the limit */
+    extendsize = grow_size(newsize);
+    if ((ptr = extend_heap(extendsize/WSIZE)) == NULL &&
+	(ptr = extend_heap(newsize/WSIZE)) == NULL)
+	return NULL;
+    place(ptr, newsize);
+
+#ifdef HEAPCHECK
+    check_step();
+#endif
+
+    return ptr;
+}
+
+/*
+ * free_block - mm_free without the statistics and the trace
+ */
+static void free_block(void *ptr)
+{
+    size_t size, prev_alloc;
+
+#ifdef MMAP_LARGE
+    if (!in_heap(ptr)) {
+	MAPPED_SUB(GET_SIZE(HDRP(ptr)));
+	munmap(MAP_START(ptr), GET_SIZE(HDRP(ptr)));
+	return;
+    }
+#endif
+
+#ifdef SLAB
+    if (IS_RUN(ptr)) {
+	slab_free(ptr);
+	return;
+    }
+#endif
+
+    size = GET_SIZE(HDRP(ptr));
+    prev_alloc = GET_PREV_ALLOC(HDRP(ptr));
+
+#ifdef QUICKLISTS
+    if (size <= QL_MAXSIZE) {
+	ql_push(ptr, size);
+#ifdef HEAPCHECK
+	check_step();
+#endif
+	return;
+    }
+#endif
+
+    PUT(HDRP(ptr), PACK_HDR(size, prev_alloc, 0));
+    PUT(FTRP(ptr), PACK_FTR(size, 0));
+
+    /* Mark the prev alloc tag into the next block */
+    PUT_PREV_ALLOC(HDRP(NEXT_BLKP(ptr)), 0);
+
+#ifdef RELEASE_FREE
+    {
+	char *freeptr = coalesce(ptr);
+
+	/* Only the pages of the given block: the rest of a large free block was released before.
+	 * The header and the links and footer at the end of the free block must stay mapped. */
+	if (GET_SIZE(HDRP(freeptr)) >= TRIM_THRESHOLD) {
+	    char *lo = PAGE_UP(ptr);
+	    char *hi = PAGE_DOWN(((char *)ptr + size < PREDP(freeptr)) ? (char *)ptr + size : PREDP(freeptr));
+	    if (lo < hi)
+		madvise(lo, hi - lo, MADV_DONTNEED);
+	}
+    }
+#else
+    coalesce(ptr);
+#endif
+
+#ifdef HEAPCHECK
+    check_step();
+#endif
+}
+
+/*
+ * realloc_block - Reallocate block at the same address as the given address as possible.
+ * 		A growing block takes in the next free block (extending the heap if it is the last one),
+ * 		or else the previous free block, moving the data down with memmove. malloc_block, memcpy and
+ * 		free_block are used only when neither has enough room.
+ * 		A block that was grown before is likely to be grown again, so it gets slack: room for
+ * 		REALLOC_SLACK more steps of the same size, at most doubling it. It keeps the slack
+ * 		when shrunk unless it shrinks to less than half.
+ */
+static void *realloc_block(void *ptr, size_t size)
+{
+    void *oldptr = ptr;
+    void *newptr, *nextptr, *prevptr, *retptr;
+    size_t oldsize, newsize, asize, slack, avail, next_size;
+
+    if (ptr == NULL)
+	return malloc_block(size);
+    if (size == 0) {
+	free_block(ptr);
+	return NULL;
+    }
+    if (size > MAXREQUEST)
+	return NULL;
+
+#ifdef MMAP_LARGE
+    if (!in_heap(oldptr))
+	return mmap_realloc(oldptr, size);
+#endif
+
+#ifdef SLAB
+    /* An object stays in its run while it fits, and moves to a new block otherwise */
+    if (IS_RUN(oldptr)) {
+	oldsize = RUNP(oldptr)->objsize;
+	if (size <= oldsize)
+	    return oldptr;
+	if ((newptr = malloc_block(size)) == NULL)
+	    return NULL;
+	memcpy(newptr, oldptr, oldsize);
+	slab_free(oldptr);
+	return newptr;
+    }
+#endif
+
+    /* Caculate the new block size which include overhead and alignment */
+    newsize = ALIGN(size + WSIZE);
+    oldsize = GET_SIZE(HDRP(oldptr));
+
+    /* The block is downsized through reallocating */
+    if (newsize <= oldsize) {
+	if (!GET_GROWN(HDRP(oldptr)) || newsize < oldsize/2)
+	    trim_block(oldptr, newsize);
+	return oldptr;
+    }
+
+    /* The size with slack for a block grown before */
+    asize = newsize;
+    if (GET_GROWN(HDRP(oldptr))) {
+	slack = REALLOC_SLACK * (newsize - oldsize);
+	asize += (slack < newsize) ? slack : newsize;
+	if (asize > MAXREQUEST)
+	    asize = newsize;
+    }
+
+    /* Given block is the last block of the heap, or only a free block follows it: extend the heap */
+    nextptr = NEXT_BLKP(oldptr);
+    next_size = GET_ALLOC(HDRP(nextptr)) ? 0 : GET_SIZE(HDRP(nextptr));
+    if (GET_SIZE(HDRP(nextptr)) == 0 || (next_size && GET_SIZE(HDRP(NEXT_BLKP(nextptr))) == 0)) {
+	/* Near the heap limit, without the slack and the growth chunk. If even that fails, the block moves */
+	if (oldsize + next_size < asize && extend_heap(grow_size(asize - oldsize - next_size)/WSIZE) == NULL) {
+	    asize = newsize;
+	    if (oldsize + next_size < newsize)
+		extend_heap((newsize - oldsize - next_size)/WSIZE);
+	}
+	next_size = GET_ALLOC(HDRP(nextptr)) ? 0 : GET_SIZE(HDRP(nextptr));
+    }
+
+    /* Next block can be used to extend the size */
+    if (next_size && oldsize + next_size >= newsize) {
+	remove_block(nextptr);
+	CHECK_MERGED(nextptr, oldptr);
+	avail = oldsize + next_size;
+	PUT(HDRP(oldptr), PACK_HDR(avail, GET_PREV_ALLOC(HDRP(oldptr)), 1));
+	PUT_PREV_ALLOC(HDRP(NEXT_BLKP(oldptr)), 1);
+	trim_block(oldptr, (avail >= asize) ? asize : newsize);
+	retptr = oldptr;
+    }
+    /* Previous block (and the next one) can be used: the data moves down */
+    else if (!GET_PREV_ALLOC(HDRP(oldptr)) &&
+	     (avail = GET_SIZE(HDRP(PREV_BLKP(oldptr))) + oldsize + next_size) >= newsize) {
+	prevptr = PREV_BLKP(oldptr);
+	remove_block(prevptr);
+	if (next_size) {
+	    remove_block(nextptr);
+	    CHECK_MERGED(nextptr, prevptr);
+	}
+	CHECK_MERGED(oldptr, prevptr);
+	PUT(HDRP(prevptr), PACK_HDR(avail, GET_PREV_ALLOC(HDRP(prevptr)), 1));
+	memmove(prevptr, oldptr, oldsize - WSIZE);
+	PUT_PREV_ALLOC(HDRP(NEXT_BLKP(prevptr)), 1);
+	trim_block(prevptr, (avail >= asize) ? asize : newsize);
+	retptr = prevptr;
+    }
+    /* Default: Just allocate new block and free the old block */
+    else {
+	if ((newptr = malloc_block(asize - WSIZE)) == NULL &&
+	    (asize == newsize || (newptr = malloc_block(size)) == NULL))
+	    return NULL;
+	memcpy(newptr, oldptr, oldsize - WSIZE);
+	free_block(oldptr);
+	retptr = newptr;
+    }
+
+    /* Mark the block for slack in the next reallocation */
+#ifdef SLAB
+    if (!IS_RUN(retptr))
+#endif
+	PUT(HDRP(retptr), GET(HDRP(retptr)) | 0x8);
+
+#ifdef HEAPCHECK
+    check_step();
+#endif
+
+    return retptr;
+}
+
+/*
+ * mm_usable_size - Return the number of payload bytes of the allocated block.
+ * 		    It can be larger than the size requested because of alignment and splitting.
+ */
+size_t mm_usable_size(void *ptr)
+{
+#ifdef MMAP_LARGE
+    if (!in_heap(ptr))
+	return GET_SIZE(HDRP(ptr)) - GET(MAP_OFFP(ptr));
+#endif
+#ifdef SLAB
+#ifdef ARENAS
+    /* Called without entering an arena. first_listp is per thread, and enter_arena sets it again */
+    first_listp = arenas[mm_arena_of(ptr)].listp;
+#endif
+    if (IS_RUN(ptr))
+	return RUNP(ptr)->objsize;
+#endif
+    return GET_SIZE(HDRP(ptr)) - WSIZE;
+}
+
+/*
+ * mm_memalign - Allocate a block which has payload of at least given size bytes aligned to align (a power of 2)
+ */
+void *mm_memalign(size_t align, size_t size)
+{
+    void *ptr;
+
+    if (align <= ALIGNMENT)
+	return mm_malloc(size);
+    if ((align & (align - 1)) != 0 || size == 0 || size > MAXREQUEST || align > MAXREQUEST - size)
+	return NULL;
+
+#ifdef MMAP_LARGE
+    if (size >= mmap_threshold)
+	ptr = mmap_malloc(size, align);
+    else
+#endif
+    {
+	grow_since++;
+	ptr = alloc_aligned(ALIGN(size + WSIZE), align, NULL);
+    }
+
+    STAT_ADD(malloc_calls, 1);
+    STAT_ADD(class_allocs[get_index(ALIGN(size + WSIZE))], 1);
+    TRACE(MM_TRACE_MALLOC, ptr, NULL, size);
+#ifdef HEAPCHECK
+    check_step();
+#endif
+
+    return ptr;
+}
+
+/*
+ * mm_aligned_alloc - mm_memalign with the constraint of C11 aligned_alloc: size must be a multiple of align
+ */
+void *mm_aligned_alloc(size_t align, size_t size)
+{
+    if (align == 0 || (size & (align - 1)) != 0)
+	return NULL;
+    return mm_memalign(align, size);
+}
+
+/*
+ * alloc_aligned - Allocate a block of the given block size whose payload is aligned to align
+ * 		   (a power of 2) from base, or in memory if base is NULL. A free block that already holds an
+ * 		   aligned block is taken whole. Otherwise a block with room for the alignment is allocated.
+ * 		   Then the free space in front of and behind the aligned block is freed.
+ */
+static void *alloc_aligned(size_t newsize, size_t align, char *base)
+{
+    size_t asize = newsize + align + MINBLOCKSIZE;
+    size_t blocksize, lead;
+    char *ptr, *alignptr;
+
+    if ((ptr = find_aligned_fit(newsize, align, base)) != NULL)
+	place(ptr, GET_SIZE(HDRP(ptr)));
+    else {
+	/* Coalesce the quick lists and search again before extending the heap */
+	ptr = find_fit(asize);
+#ifdef QUICKLISTS
+	if (ptr == NULL && ql_flush_all() > 0)
+	    ptr = find_fit(asize);
+#endif
+	if (ptr == NULL && (ptr = extend_heap(grow_size(asize)/WSIZE)) == NULL &&
+	    (ptr = extend_heap(asize/WSIZE)) == NULL)
+	    return NULL;
+	place(ptr, asize);
+    }
+    blocksize = GET_SIZE(HDRP(ptr));
+
+    if ((lead = aligned_lead(ptr, align, base)) != 0) {
+	alignptr = ptr + lead;
+	PUT(HDRP(ptr), PACK_HDR(lead, GET_PREV_ALLOC(HDRP(ptr)), 0));
+	PUT(FTRP(ptr), PACK_FTR(lead, 0));
+	PUT(HDRP(alignptr), PACK_HDR(blocksize - lead, 0, 1));
+	coalesce(ptr);
+	ptr = alignptr;
+    }
+
+    trim_block(ptr, newsize);
+
+    return ptr;
+}
+
+/*
+ * find_aligned_fit - Find the free block in which a block of the given size fits at an aligned payload.
+ * 		      Only the classes below the one where any block fits (and the last class) are searched, in first
+ * 		      fit manner and for ALIGN_SCAN blocks at most, since a block there fits only if it happens to be well placed.
+ */
+static void *find_aligned_fit(size_t newsize, size_t align, char *base)
+{
+    int index, last = get_index(newsize + align + MINBLOCKSIZE);
+    int scanned = 0;
+    char *ptr;
+
+    /* The last class holds blocks of any size */
+    for (index = find_class(get_index(newsize)); index >= 0 && (index < last || index == NUMOFCLASS - 1);
+	 index = (index < NUMOFCLASS - 1) ? find_class(index + 1) : -1) {
+	for (ptr = GET_PTR(first_listp + (index * WSIZE)); ptr != NULL; ptr = GET_PTR(SUCCP(ptr))) {
+	    STAT_ADD(fit_scanned, 1);
+	    if (aligned_lead(ptr, align, base) + newsize <= GET_SIZE(HDRP(ptr)))
+		return ptr;
+	    if (++scanned >= ALIGN_SCAN)
+		return NULL;
+	}
+    }
+    return NULL;
+}
+
+/*
+ * aligned_lead - Return the distance from the block to the first payload aligned to align from base,
+ * 		  leaving in front either nothing or room for a free block
+ */
+static size_t aligned_lead(char *ptr, size_t align, char *base)
+{
+    size_t lead = (align - ((size_t)(ptr - base) & (align - 1))) & (align - 1);
+
+    while (lead != 0 && lead < MINBLOCKSIZE)
+	lead += align;
+    return lead;
+}
+
+/*
+ * heap_block - Return whether ptr is a block of the heap, rather than a mapping of its own or a slab object
+ */
+static int heap_block(void *ptr)
+{
+#if !defined(MMAP_LARGE) && !defined(SLAB)
+    (void)ptr;
+#endif
+#ifdef MMAP_LARGE
+    if (!in_heap(ptr))
+	return 0;
+#endif
+#ifdef SLAB
+    if (IS_RUN(ptr))
+	return 0;
+#endif
+    return 1;
+}
+
+/*
+ * sort_ptrs - Sort the pointers in ascending address order in place with a heapsort.
+ * 	       qsort is not used since it may call malloc.
+ */
+static void sort_ptrs(void **ptrs, size_t n)
+{
+    size_t i;
+    void *tmp;
+
+    for (i = n / 2; i > 0; i--)
+	sift_ptrs(ptrs, i - 1, n);
+    for (i = n; i > 1; i--) {
+	/* Move the largest behind the heap */
+	tmp = ptrs[0];
+	ptrs[0] = ptrs[i - 1];
+	ptrs[i - 1] = tmp;
+	sift_ptrs(ptrs, 0, i - 1);
+    }
+}
+
+/*
+ * sift_ptrs - Sift ptrs[root] down the max-heap of the first n pointers
+ */
+static void sift_ptrs(void **ptrs, size_t root, size_t n)
+{
+    size_t child;
+    void *tmp;
+
+    for (; (child = 2*root + 1) < n; root = child) {
+	if (child + 1 < n && (char *)ptrs[child] < (char *)ptrs[child + 1])
+	    child++;
+	if ((char *)ptrs[root] >= (char *)ptrs[child])
+	    return;
+	tmp = ptrs[root];
+	ptrs[root] = ptrs[child];
+	ptrs[child] = tmp;
+    }
+}
+
+#ifdef MMAP_LARGE
+/*
+ * mm_set_mmap_threshold - Map requests of the given size or more separately from now on
+ */
+void mm_set_mmap_threshold(size_t size)
+{
+    mmap_threshold = size;
+}
+
+/*
+ * mmap_malloc - Map a region for the request whose payload is aligned to align (a power of 2, at least ALIGNMENT).
+ * 		 It starts with padding so that the header is right in front of the payload; the size in the
+ * 		 header is the length of the region. An alignment beyond a page is found by mapping align bytes
+ * 		 more and unmapping the pages on both sides.
+ */
+static void *mmap_malloc(size_t size, size_t align)
+{
+    size_t offset = (align < PAGESIZE) ? align : PAGESIZE;
+    size_t len = (size + offset + PAGESIZE - 1) & ~(size_t)(PAGESIZE - 1);
+    size_t extra = (align > PAGESIZE) ? align - PAGESIZE : 0;
+    char *map, *start, *ptr;
+
+    if ((map = mmap(NULL, len + extra, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0)) == MAP_FAILED)
+	return NULL;
+
+    /* The first aligned payload with room for the padding in front */
+    ptr = (char *)(((size_t)map + offset + align - 1) & ~(align - 1));
+    start = ptr - offset;
+    if (start > map)
+	munmap(map, start - map);
+    if (start + len < map + len + extra)
+	munmap(start + len, map + len + extra - (start + len));
+
+    PUT(MAP_OFFP(ptr), offset);
+    PUT(HDRP(ptr), PACK_HDR(len, 1, 1));
+    MAPPED_ADD(len);
+
+    return ptr;
+}
+
+/*
+ * mmap_realloc - Resize the mapping with mremap, or move the block into the heap if it is no longer large
+ */
+static void *mmap_realloc(void *ptr, size_t size)
+{
+    size_t oldlen = GET_SIZE(HDRP(ptr));
+    size_t offset = GET(MAP_OFFP(ptr));
+    size_t len = (size + offset + PAGESIZE - 1) & ~(size_t)(PAGESIZE - 1);
+    char *newptr;
+
+    if (size < mmap_threshold) {
+	/* The threshold may have been raised since, so the mapping may hold less than size */
+	if ((newptr = malloc_block(size)) == NULL)
+	    return NULL;
+	memcpy(newptr, ptr, (size < oldlen - offset) ? size : oldlen - offset);
+	free_block(ptr);
+	return newptr;
+    }
+
+    if (len == oldlen)
+	return ptr;
+    /* The offset stays in the padding; the payload keeps an alignment up to a page */
+    if ((newptr = mremap((char *)ptr - offset, oldlen, len, MREMAP_MAYMOVE)) == MAP_FAILED)
+	return NULL;
+
+    newptr += offset;
+    PUT(HDRP(newptr), PACK_HDR(len, 1, 1));
+    MAPPED_ADD(len);
+    MAPPED_SUB(oldlen);
+
+    return newptr;
+}
+
+/*
+ * in_heap - Return whether the block is in the heap (or in an arena) rather than mapped by mmap_malloc
+ */
+static int in_heap(void *ptr)
+{
+#ifdef ARENAS
+    if (mm_arena_of(ptr) != 0)
+	return 1;
+#endif
+    return ptr >= mem_heap_lo() && ptr <= mem_heap_hi();
+}
+#endif
+
+/*
+ * mm_mapped_bytes - Return the total length of the mappings of large blocks (0 without MMAP_LARGE)
+ */
+size_t mm_mapped_bytes(void)
+{
+#ifdef MMAP_LARGE
+    return __atomic_load_n(&mapped_bytes, __ATOMIC_RELAXED);
+#else
+    return 0;
+#endif
+}
+
+#ifdef SLAB
+/*
+ * slab_malloc - Take the first free object from the first run of the class of the size,
+ * 		 creating a run if the class has none with free objects.
+ */
+static void *slab_malloc(size_t size)
+{
+    int class = (size - 1) / SLAB_STEP;
+    struct run *run = (struct run *)GET_PTR(RUN_HEADP(class));
+    int i, bit;
+
+    if (run == NULL && (run = new_run(class)) == NULL)
+	return NULL;
+
+    for (i = 0; run->map[i] == 0; i++)
+	;
+    bit = FFS(run->map[i]);
+    run->map[i] &= ~(1u << bit);
+
+    /* A full run leaves the run list */
+    if (--run->numfree == 0) {
+	PUT_PTR(RUN_HEADP(class), run->succ);
+	if (run->succ != NULL)
+	    run->succ->pred = NULL;
+    }
+
+    return OBJP(run) + (i*32 + bit) * run->objsize;
+}
+
+/*
+ * slab_free - Mark the object free in its run. A run that was full comes back to the run list,
+ * 	       and a run that became empty is given back to the heap unless it is the only one of its class.
+ */
+static void slab_free(void *ptr)
+{
+    struct run *run = RUNP(ptr);
+    char *headp = RUN_HEADP(run->class);
+    int n = ((char *)ptr - OBJP(run)) / run->objsize;
+
+    run->map[n >> 5] |= 1u << (n & 31);
+
+    if (run->numfree++ == 0) {
+	run->pred = NULL;
+	run->succ = (struct run *)GET_PTR(headp);
+	if (run->succ != NULL)
+	    run->succ->pred = run;
+	PUT_PTR(headp, run);
+    }
+    else if (run->numfree == run->numobj && (run->pred != NULL || run->succ != NULL)) {
+	if (run->pred != NULL)
+	    run->pred->succ = run->succ;
+	else
+	    PUT_PTR(headp, run->succ);
+	if (run->succ != NULL)
+	    run->succ->pred = run->pred;
+
+	PAGE_MAPP[PAGE_INDEX(run) >> 5] &= ~(1u << (PAGE_INDEX(run) & 31));
+	free_block(run);
+    }
+}
+
+/*
+ * new_run - Carve a RUNSIZE aligned run for the class from the heap and put it on the run list
+ */
+static struct run *new_run(int class)
+{
+    struct run *run;
+    int i;
+
+    /* The block ends one header short of the next page, so consecutive runs are adjacent */
+    if ((run = alloc_aligned(RUNSIZE, RUNSIZE, first_listp)) == NULL)
+	return NULL;
+
+    run->class = class;
+    run->objsize = (class + 1) * SLAB_STEP;
+    run->numobj = run->numfree = (RUNSIZE - WSIZE - ALIGN(sizeof(struct run))) / run->objsize;
+    memset(run->map, 0, sizeof(run->map));
+    for (i = 0; i < run->numobj; i++)
+	run->map[i >> 5] |= 1u << (i & 31);
+
+    run->pred = NULL;
+    run->succ = (struct run *)GET_PTR(RUN_HEADP(class));
+    if (run->succ != NULL)
+	run->succ->pred = run;
+    PUT_PTR(RUN_HEADP(class), run);
+
+    PAGE_MAPP[PAGE_INDEX(run) >> 5] |= 1u << (PAGE_INDEX(run) & 31);
+
+    return run;
+}
+#endif
+
+#ifdef QUICKLISTS
+/*
+ * ql_push - Push the block on the quick list of its size. It stays marked allocated, so it is not coalesced.
+ * 	     The list is coalesced as a batch instead of getting more than QL_LIMIT blocks.
+ */
+static void ql_push(void *ptr, size_t size)
+{
+    int index = QL_INDEX(size);
+
+    if (GET(QL_COUNTP(index)) == QL_LIMIT)
+	ql_flush(index);
+
+    /* Not a grown block for mm_realloc once it is reused */
+    PUT(HDRP(ptr), GET(HDRP(ptr)) & ~0x8);
+    PUT_PTR(ptr, GET_PTR(QL_HEADP(index)));
+    PUT_PTR(QL_HEADP(index), ptr);
+    PUT(QL_COUNTP(index), GET(QL_COUNTP(index)) + 1);
+}
+
+/*
+ * ql_pop - Take the last block pushed on the quick list, or return NULL if it is empty
+ */
+static void *ql_pop(int index)
+{
+    char *ptr;
+
+    if ((ptr = GET_PTR(QL_HEADP(index))) == NULL)
+	return NULL;
+
+    STAT_ADD(quick_hits, 1);
+    PUT_PTR(QL_HEADP(index), GET_PTR(ptr));
+    PUT(QL_COUNTP(index), GET(QL_COUNTP(index)) - 1);
+    return ptr;
+}
+
+/*
+ * ql_flush - Free the blocks of the quick list into the free lists, coalescing them. Return how many there were.
+ */
+static int ql_flush(int index)
+{
+    char *ptr, *next;
+    size_t size;
+    int n = 0;
+
+    STAT_ADD(quick_flushes, 1);
+
+    for (ptr = GET_PTR(QL_HEADP(index)); ptr != NULL; ptr = next) {
+	next = GET_PTR(ptr);
+	size = GET_SIZE(HDRP(ptr));
+	PUT(HDRP(ptr), PACK_HDR(size, GET_PREV_ALLOC(HDRP(ptr)), 0));
+	PUT(FTRP(ptr), PACK_FTR(size, 0));
+	PUT_PREV_ALLOC(HDRP(NEXT_BLKP(ptr)), 0);
+	coalesce(ptr);
+	n++;
+    }
+    PUT_PTR(QL_HEADP(index), NULL);
+    PUT(QL_COUNTP(index), 0);
+
+    return n;
+}
+
+/*
+ * ql_flush_all - Free the blocks of every quick list. Return how many there were.
+ */
+static int ql_flush_all(void)
+{
+    int n = 0;
+
+    for (int i = 0; i < QL_NUMCLASS; i++) {
+	if (GET_PTR(QL_HEADP(i)) != NULL)
+	    n += ql_flush(i);
+    }
+    return n;
+}
+#endif
+
+#ifdef ARENAS
+/*
+ * mm_arena_init - Create arenas until there are n of them (at most MAXARENAS), after mm_init.
+ * 		   Not thread-safe; call it once before the arenas are used. Return the number of arenas.
+ */
+int mm_arena_init(int n)
+{
+    struct arena *arena;
+
+    if (n > MAXARENAS)
+	n = MAXARENAS;
+
+    while (numofarena < n) {
+	arena = &arenas[numofarena];
+	arena->lo = mmap(NULL, ARENASIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (arena->lo == MAP_FAILED)
+	    break;
+	arena->brk = arena->lo;
+	arena->max = arena->lo + ARENASIZE;
+	arena->remote = NULL;
+	pthread_mutex_init(&arena->lock, NULL);
+
+	cur_arena = arena;
+	if (init_heap() == -1) {
+	    munmap(arena->lo, ARENASIZE);
+	    break;
+	}
+	arena->listp = first_listp;
+	numofarena++;
+    }
+
+    cur_arena = &arenas[0];
+    first_listp = arenas[0].listp;
+    return numofarena;
+}
+
+/*
+ * mm_arena_of - Return the index of the arena that owns the given block
+ */
+int mm_arena_of(void *ptr)
+{
+    for (int i = 1; i < numofarena; i++) {
+	if ((char *)ptr >= arenas[i].lo && (char *)ptr < arenas[i].brk)
+	    return i;
+    }
+    return 0;
+}
+
+/*
+ * mm_arena_malloc - mm_malloc in the given arena, or in the next ones if it is out of memory
+ */
+void *mm_arena_malloc(int index, size_t size)
+{
+    struct arena *arena;
+    void *ptr = NULL;
+
+    for (int i = 0; i < numofarena && ptr == NULL; i++) {
+	arena = &arenas[(index + i) % numofarena];
+	enter_arena(arena);
+	ptr = mm_malloc(size);
+	leave_arena(arena);
+    }
+    return ptr;
+}
+
+/*
+ * mm_arena_free - mm_free for a thread bound to the given arena.
+ * 		   A block of another arena is pushed on the remote-free list of its owner instead.
+ */
+void mm_arena_free(int index, void *ptr)
+{
+    struct arena *owner = &arenas[mm_arena_of(ptr)];
+    void *head;
+
+    if (owner != &arenas[index % numofarena]) {
+	head = __atomic_load_n(&owner->remote, __ATOMIC_RELAXED);
+	do {
+	    *(void **)ptr = head;
+	} while (!__atomic_compare_exchange_n(&owner->remote, &head, ptr, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+	return;
+    }
+
+    enter_arena(owner);
+    mm_free(ptr);
+    leave_arena(owner);
+}
+
+/*
+ * mm_arena_realloc - mm_realloc in the arena that owns the block
+ */
+void *mm_arena_realloc(int index, void *ptr, size_t size)
+{
+    struct arena *owner;
+    void *newptr;
+
+    if (ptr == NULL)
+	return mm_arena_malloc(index, size);
+
+    owner = &arenas[mm_arena_of(ptr)];
+    enter_arena(owner);
+    newptr = mm_realloc(ptr, size);
+    leave_arena(owner);
+
+    return newptr;
+}
+
+/*
+ * enter_arena - Lock the arena and make it the heap that the other functions operate on.
+ * 		 The blocks other threads pushed on its remote-free list are freed first.
+ */
+static void enter_arena(struct arena *arena)
+{
+    void *ptr, *next;
+
+    pthread_mutex_lock(&arena->lock);
+    cur_arena = arena;
+    first_listp = arena->listp;
+
+    for (ptr = __atomic_exchange_n(&arena->remote, NULL, __ATOMIC_ACQUIRE); ptr != NULL; ptr = next) {
+	next = *(void **)ptr;
+	mm_free(ptr);
+    }
+}
+
+/*
+ * leave_arena - Unlock the arena entered by enter_arena
+ */
+static void leave_arena(struct arena *arena)
+{
+    pthread_mutex_unlock(&arena->lock);
+}
+#endif
+
+#ifdef MM_STATS
+/*
+ * mm_get_stats - Copy the counters into st and add up the blocks of the heap (of every arena).
+ * 		  Other threads may be updating the counters; each one is read as it is at that moment.
+ */
+void mm_get_stats(struct mm_stats *st)
+{
+    *st = stats;
+    st->mapped_bytes = mm_mapped_bytes();
+    st->heap_bytes = st->inuse_bytes = st->free_bytes = st->free_blocks = st->largest_free = 0;
+
+#ifdef ARENAS
+    for (int i = 0; i < numofarena; i++) {
+	enter_arena(&arenas[i]);
+	walk_heap(st);
+	leave_arena(&arenas[i]);
+    }
+#else
+    walk_heap(st);
+#endif
+
+    st->fragmentation = st->free_bytes ? 1.0 - (double)st->largest_free / st->free_bytes : 0.0;
+}
+
+/*
+ * mm_reset_stats - Set every counter to zero
+ */
+void mm_reset_stats(void)
+{
+    memset(&stats, 0, sizeof(stats));
+}
+
+/*
+ * walk_heap - Add the blocks of the current heap to the heap fields of st.
+ * 	       The free objects of the runs are not in use, even though their runs are allocated blocks.
  */
-void *mm_malloc(size_t size)
+static void walk_heap(struct mm_stats *st)
 {
-    size_t newsize;
-    size_t extendsize;
     char *ptr;
+    size_t size;
 
-    /* Ignore spurious requests */
-    if (size == 0)
-	return NULL;
+    for (ptr = first_listp + HEAPSTART; (size = GET_SIZE(HDRP(ptr))) > 0; ptr = NEXT_BLKP(ptr)) {
+	if (GET_ALLOC(HDRP(ptr))) {
+	    st->inuse_bytes += size;
+	}
+	else {
+	    st->free_bytes += size;
+	    st->free_blocks++;
+	    if (size > st->largest_free)
+		st->largest_free = size;
+	}
+    }
+    st->heap_bytes += ptr - first_listp;
 
-    /* Caculate the new block size which include overhead, alignment and pointer reqs */
-    if (size <= SIZE_T_SIZE) {
-	newsize = 2*SIZE_T_SIZE;
+#ifdef SLAB
+    for (int i = 0; i < SLAB_NUMCLASS; i++) {
+	for (struct run *run = (struct run *)GET_PTR(RUN_HEADP(i)); run != NULL; run = run->succ)
+	    st->inuse_bytes -= run->numfree * run->objsize;
     }
-    else {
-	newsize = ALIGN(size + WSIZE);		/* Add overhead for header */
+#endif
+#ifdef QUICKLISTS
+    /* The blocks of the quick lists are marked allocated, but free */
+    for (int i = 0; i < QL_NUMCLASS; i++) {
+	for (ptr = GET_PTR(QL_HEADP(i)); ptr != NULL; ptr = GET_PTR(ptr)) {
+	    st->inuse_bytes -= GET_SIZE(HDRP(ptr));
+	    st->free_bytes += GET_SIZE(HDRP(ptr));
+	    st->free_blocks++;
+	}
     }
+#endif
+}
+#endif
 
-    /* Get the appropriate head pointer for the requested size */
-    head_ptr = get_listp(newsize);
+#ifdef MM_TRACE
+/*
+ * mm_trace_open - Start writing the trace to the file at path, replacing its contents. Return 0, or -1 on error
+ */
+int mm_trace_open(const char *path)
+{
+    if (trace_fd >= 0)
+	mm_trace_close();
+    trace_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644);
+    return (trace_fd >= 0) ? 0 : -1;
+}
 
-    /* Search the free list for a fit */
-    if ((ptr = find_fit(newsize)) != NULL) {
-	place(ptr, newsize);
-	return ptr;
-    }
+/*
+ * mm_trace_flush - Write out the events the calling thread has buffered
+ */
+void mm_trace_flush(void)
+{
+    trace_write(trace_buf, &trace_len);
+}
 
-    /* No fit found. Get more memory and place the block */
-    extendsize = (newsize > CHUNKSIZE ? newsize : CHUNKSIZE);
-    if ((ptr = extend_heap(extendsize/WSIZE)) == NULL)
-	return NULL;
-    place(ptr, newsize);
+/*
+ * mm_trace_close - Write out the events of every thread and stop tracing.
+ * 		    With ARENAS, no other thread may be calling into mm.c meanwhile.
+ */
+void mm_trace_close(void)
+{
+#ifdef ARENAS
+    struct trace_thread *t;
 
-#ifdef HEAPCHECK
-    mm_check();
+    pthread_mutex_lock(&trace_lock);
+    for (t = trace_threads; t != NULL; t = t->next)
+	trace_write(t->buf, t->len);
+    pthread_mutex_unlock(&trace_lock);
 #endif
-
-    return ptr;
+    mm_trace_flush();
+    if (trace_fd >= 0)
+	close(trace_fd);
+    trace_fd = -1;
 }
 
 /*
- * mm_free - Free the block pointed to by ptr.
+ * trace - Buffer an event of the calling thread, writing the buffer out when it is full.
+ * 	   The time is the time stamp counter on x86, and CLOCK_MONOTONIC in ns elsewhere.
  */
-void mm_free(void *ptr)
+static void trace(unsigned int op, void *ptr, void *oldptr, size_t size)
 {
-    size_t size = GET_SIZE(HDRP(ptr));
-    size_t prev_alloc = GET_PREV_ALLOC(HDRP(ptr));
+    struct mm_trace_event *ev;
+#if !defined(__x86_64__) && !defined(__i386__)
+    struct timespec ts;
+#endif
 
-    PUT(HDRP(ptr), PACK_HDR(size, prev_alloc, 0));
-    PUT(FTRP(ptr), PACK_FTR(size, 0));
+    if (trace_fd < 0)
+	return;
+#ifdef ARENAS
+    if (trace_self.buf == NULL)
+	trace_register();
+#endif
 
-    /* Mark the prev alloc tag into the next block */
-    PUT_PREV_ALLOC(HDRP(NEXT_BLKP(ptr)), 0);
+    ev = &trace_buf[trace_len++];
+#if defined(__x86_64__) || defined(__i386__)
+    ev->time = __builtin_ia32_rdtsc();
+#else
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    ev->time = ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+#endif
+    ev->ptr = (size_t)ptr;
+    ev->oldptr = (size_t)oldptr;
+    ev->size = size;
+    ev->op = op;
+#ifdef ARENAS
+    ev->arena = cur_arena - arenas;
+#else
+    ev->arena = 0;
+#endif
 
-    coalesce(ptr);
+    if (trace_len == TRACE_BUFEVENTS)
+	mm_trace_flush();
+}
 
-#ifdef HEAPCHECK
-    mm_check();
-#endif
+/*
+ * trace_write - Write out the buffered events, and empty the buffer
+ */
+static void trace_write(struct mm_trace_event *buf, int *len)
+{
+    if (trace_fd >= 0 && *len > 0 &&
+	write(trace_fd, buf, *len * sizeof(struct mm_trace_event)) < 0)
+	perror("mm_trace_flush");
+    *len = 0;
 }
 
+#ifdef ARENAS
 /*
- * mm_realloc - Reallocate block at the same address as the given address as possible.
- * 		A block is allcated using mm_malloc and mm_free only when it isn't possible
- * 		to reallocate at the same address because there's no usable free space.
+ * trace_register - Add the buffer of the calling thread to the list on its first event
  */
-void *mm_realloc(void *ptr, size_t size)
+static void trace_register(void)
 {
-    void *oldptr = ptr;
-    void *newptr = NULL;
-    void *extendptr, *retptr;
-    size_t oldsize, newsize, prev_alloc, next_alloc, next_size, sizediff, extendsize;
+    pthread_once(&trace_once, trace_key_create);
 
-    /* Caculate the new block size which include overhead, alignment and pointer reqs */
-    if ((ptr == NULL) && (!size))
-	return NULL;
+    trace_self.buf = trace_buf;
+    trace_self.len = &trace_len;
+    pthread_mutex_lock(&trace_lock);
+    trace_self.next = trace_threads;
+    trace_threads = &trace_self;
+    pthread_mutex_unlock(&trace_lock);
 
-    if (size <= SIZE_T_SIZE) {
-	newsize = 2*SIZE_T_SIZE;
-    }
-    else {
-	newsize = ALIGN(size + WSIZE);		/* Add overhead for header */
-    }
+    /* A non-NULL value, so trace_exit runs when the thread exits */
+    pthread_setspecific(trace_key, &trace_self);
+}
 
-    oldsize = GET_SIZE(HDRP(oldptr));
-    prev_alloc = GET_PREV_ALLOC(HDRP(oldptr));
-    next_alloc = GET_ALLOC(HDRP(NEXT_BLKP(oldptr)));
-    next_size = GET_SIZE(HDRP(NEXT_BLKP(oldptr)));
-
-    sizediff = (oldsize > newsize) ? (oldsize - newsize) : (newsize - oldsize); 
-
-    if (oldsize >= newsize) {			/* The block is downsized through reallocating */
-        /* The size of free block need to be splited */
-	if (sizediff >= 2*SIZE_T_SIZE) {
-	    ptr = split_block(oldptr, newsize, sizediff);
-	    coalesce(ptr);
-	    retptr = oldptr;
-	}
-        /* The size of free block doesn't need to be splited */
-	else {
-	    retptr = oldptr;
+static void trace_key_create(void)
+{
+    pthread_key_create(&trace_key, trace_exit);
+}
+
+/*
+ * trace_exit - Write out the events of the exiting thread and remove its buffer from the list
+ */
+static void trace_exit(void *arg)
+{
+    struct trace_thread *self = arg;
+    struct trace_thread **tp;
+
+    pthread_mutex_lock(&trace_lock);
+    for (tp = &trace_threads; *tp != NULL; tp = &(*tp)->next) {
+	if (*tp == self) {
+	    *tp = self->next;
+	    break;
 	}
     }
-    /* The block is extended through reallocating */
-    else if (!GET_SIZE(HDRP(NEXT_BLKP(oldptr)))) {		/* Given block is the last block of the heap */
-	/* Extend the heap */
-        extendsize = (sizediff > CHUNKSIZE ? sizediff : CHUNKSIZE);
-        if ((long)(extendptr = mem_sbrk(extendsize)) == -1)
-	    return NULL;
-
-        /* Initialize free block header/footer */
-        PUT(HDRP(extendptr), PACK_HDR(extendsize, 1, 0));		/* Extended block header */
-        PUT(FTRP(extendptr), PACK_FTR(extendsize, 0)); 			/* Extended block footer */
-        PUT(HDRP(NEXT_BLKP(extendptr)), PACK_HDR(0, 0, 1));		/* New epilogue header */
+    trace_write(self->buf, self->len);
+    pthread_mutex_unlock(&trace_lock);
+}
+#endif
+#endif
 
-        /* The size of free block need to be splited */
-	if ((extendsize - sizediff) > 2*SIZE_T_SIZE) {
-	    ptr = split_block(oldptr, newsize, extendsize - sizediff);
-	    coalesce(ptr);
-	    retptr = oldptr;
-	}
-        /* The size of free block doesn't need to be splited */
-	else {
-	    newsize = oldsize + extendsize;
-	    PUT(HDRP(oldptr), PACK_HDR(newsize, prev_alloc, 1));
-	    retptr = oldptr;
-	}
-    }	
-    else {	
-        /* Next block can be used to extend the size */	    
-	if ((!next_alloc) && (next_size >= sizediff)) {
-	    /* Remove old block from the appropriate free list */
-	    remove_block(NEXT_BLKP(oldptr));
-            /* The size of free block need to be splited */
-	    if ((next_size - sizediff) >= 2*SIZE_T_SIZE) {
-	        /* The former block is allocated*/
-		ptr = split_block(oldptr, newsize, next_size - sizediff);
-		coalesce(ptr);
-		retptr = oldptr;
-	    }
-            /* The size of free block doesn't need to be splited */
-	    else {
-		PUT(HDRP(oldptr), PACK_HDR(oldsize + next_size, prev_alloc, 1));
-		retptr = oldptr;
-	    }
-	}
-	/* Default: Just allocate new block and free the old block */
-	else {
-	    newptr = mm_malloc(size);
-	
-	    memcpy(newptr, oldptr, (newsize - WSIZE));
-	    mm_free(oldptr);
+/*
+ * mm_set_growth - Set the bounds of a heap extension beyond the request, and the heap size fraction
+ * 		   (1/2^shift, or none if shift is 0) it grows by at least. Call it before mm_init.
+ */
+void mm_set_growth(size_t minchunk, size_t maxchunk, int shift)
+{
+    grow_min = ALIGN(minchunk > MINBLOCKSIZE ? minchunk : MINBLOCKSIZE);
+    grow_max = ALIGN(maxchunk > grow_min ? maxchunk : grow_min);
+    grow_shift = shift;
+}
 
-	    retptr = newptr;
-	}
+/*
+ * grow_size - Return how many bytes to extend the heap by for a block of the given size.
+ * 	       Extensions close together double the growth chunk, extensions far apart halve it.
+ */
+static size_t grow_size(size_t size)
+{
+    size_t chunk, heapsize;
+
+    if (grow_since < GROW_WINDOW)
+	grow_chunk = (2*grow_chunk < grow_max) ? 2*grow_chunk : grow_max;
+    else
+	grow_chunk = (grow_chunk/2 > grow_min) ? grow_chunk/2 : grow_min;
+    grow_since = 0;
+
+    chunk = grow_chunk;
+    if (grow_shift > 0) {
+#ifdef ARENAS
+	heapsize = (cur_arena != &arenas[0]) ? (size_t)(cur_arena->brk - cur_arena->lo) : mem_heapsize();
+#else
+	heapsize = mem_heapsize();
+#endif
+	heapsize = ALIGN(heapsize >> grow_shift);
+	if (heapsize > chunk)
+	    chunk = (heapsize < grow_max) ? heapsize : grow_max;
     }
 
-#ifdef HEAPCHECK
-    mm_check();
+    return (size > chunk) ? size : chunk;
+}
+
+/*
+ * heap_sbrk - Extend the current heap by incr bytes and return the start of the new area.
+ * 	       It is mem_sbrk, except for the arenas with their own region.
+ */
+static void *heap_sbrk(int incr)
+{
+#ifdef ARENAS
+    char *old;
 #endif
 
-    return retptr;
+    STAT_ADD(sbrk_calls, 1);
+#ifdef ARENAS
+
+    if (cur_arena != &arenas[0]) {
+	if (incr < 0 || cur_arena->brk + incr > cur_arena->max)
+	    return (void *)-1;
+	old = cur_arena->brk;
+	cur_arena->brk += incr;
+	return old;
+    }
+#endif
+    return mem_sbrk(incr);
 }
 
 /*
  * coalesce - If the given block doesn't need to be coalesced, just insert the block to the appropriate free list.
  * 	      It the given block need to be coalesced, 1) Remove old block from the list
  * 	      					       2) Create new, large coalesced block
- * 	      					       3) Add new block to free list (Insertion policy: address order)
+ * 	      					       3) Add new block to free list (Insertion policy: INSERT_POLICY)
  */
 static void *coalesce(void *ptr)
 {
-    void *searchptr, *insertptr;
+    void *insertptr;
+#if INSERT_POLICY != INSERT_LIFO
+    void *searchptr;
+#endif
+#if INSERT_POLICY == INSERT_BOUNDED
+    int scanned;
+#endif
     size_t prev_alloc = GET_PREV_ALLOC(HDRP(ptr));
     size_t next_alloc = GET_ALLOC(HDRP(NEXT_BLKP(ptr)));
     size_t size = GET_SIZE(HDRP(ptr));
 
     /* Case 1: Given block doesn't need to be coalesced */
     if (prev_alloc && next_alloc) {
+	STAT_ADD(coalesce_cases[0], 1);
     }
     /* Case 2: Given block need to be coalesced wih next block */
     else if (prev_alloc && !next_alloc) {		/* Case 2 */
+	STAT_ADD(coalesce_cases[1], 1);
+
 	/* Remove old block from the appropriate free list */
 	remove_block(NEXT_BLKP(ptr));
+	CHECK_MERGED(NEXT_BLKP(ptr), ptr);
 
 	size += GET_SIZE(HDRP(NEXT_BLKP(ptr)));
 	PUT(HDRP(ptr), PACK_HDR(size, prev_alloc, 0));
@@ -377,8 +1944,11 @@ static void *coalesce(void *ptr)
     }
     /* Case 3: Given block need to be coalesced wih prev block */
     else if (!prev_alloc && next_alloc) {
+	STAT_ADD(coalesce_cases[2], 1);
+
 	/* Remove old block from the appropriate free list */
 	remove_block(PREV_BLKP(ptr));
+	CHECK_MERGED(ptr, PREV_BLKP(ptr));
 
 	size += GET_SIZE(HDRP(PREV_BLKP(ptr)));
 	PUT(FTRP(ptr), PACK_FTR(size, 0));
@@ -388,9 +1958,13 @@ static void *coalesce(void *ptr)
     }
     /* Case 4: Given block need to be coalesced with prev and next block */
     else {
+	STAT_ADD(coalesce_cases[3], 1);
+
 	/* Remove old block from the appropriate free list */
 	remove_block(NEXT_BLKP(ptr));
 	remove_block(PREV_BLKP(ptr));
+	CHECK_MERGED(NEXT_BLKP(ptr), PREV_BLKP(ptr));
+	CHECK_MERGED(ptr, PREV_BLKP(ptr));
 
 	size += GET_SIZE(HDRP(PREV_BLKP(ptr))) + GET_SIZE(FTRP(NEXT_BLKP(ptr)));
 	prev_alloc = GET_PREV_ALLOC(HDRP(PREV_BLKP(ptr)));
@@ -402,6 +1976,20 @@ static void *coalesce(void *ptr)
     /* Get the appropriate free list */
     head_ptr = get_listp(size);
     
+#if INSERT_POLICY == INSERT_LIFO
+    /* Insert the new free block at the head of the free list */
+    insertptr = head_ptr;
+#elif INSERT_POLICY == INSERT_BOUNDED
+    /* Insert the new free block in address order, looking at no more than INSERT_SCAN blocks.
+     * Blocks freed far down a crowded list are left near the head, where find_fit looks first. */
+    insertptr = head_ptr;
+    scanned = 0;
+    for (searchptr = GET_PTR(head_ptr); searchptr != NULL && searchptr < ptr && scanned < INSERT_SCAN;
+	 searchptr = GET_PTR(SUCCP(searchptr))) {
+	insertptr = searchptr;
+	scanned++;
+    }
+#else
     /* Insert the new free block in address order */
     /* Case 1: the block will be inserted to the first of the free list */
     if (GET_PTR(head_ptr) == NULL) {
@@ -426,6 +2014,7 @@ static void *coalesce(void *ptr)
 	    }
 	}
     }
+#endif
     insert_block(insertptr, ptr);
 
     return ptr;
@@ -437,11 +2026,19 @@ static void *coalesce(void *ptr)
  */
 static void insert_block(void *predptr, void *ptr)
 {
+    int index, fl;
+
     if (predptr == head_ptr) {
 	if (GET_PTR(head_ptr) == NULL) {
 	    PUT_PTR(PREDP(ptr), NULL);
 	    PUT_PTR(SUCCP(ptr), NULL);
 	    PUT_PTR(head_ptr, ptr);
+
+	    /* The list is no longer empty */
+	    index = (head_ptr - first_listp) / WSIZE;
+	    fl = index >> SUBCLASSBITS;
+	    PUT(SL_BITMAPP(fl), GET(SL_BITMAPP(fl)) | (1 << (index & (NUMOFSUBCLASS - 1))));
+	    PUT(FL_BITMAPP, GET(FL_BITMAPP) | (1 << fl));
 	}
 	else {
 	    PUT_PTR(PREDP(ptr), NULL);
@@ -468,9 +2065,17 @@ static void insert_block(void *predptr, void *ptr)
  */
 static void remove_block(void *ptr)
 {
+    int index, fl;
+
     /* Get the appropriate free list for the given block */
     head_ptr = get_listp(GET_SIZE(HDRP(ptr)));
 
+#if FIT_POLICY == FIT_NEXT
+    /* The rover moves on to the next block */
+    if (GET_PTR(ROVERP((head_ptr - first_listp) / WSIZE)) == ptr)
+	PUT_PTR(ROVERP((head_ptr - first_listp) / WSIZE), GET_PTR(SUCCP(ptr)));
+#endif
+
     if ((GET_PTR(PREDP(ptr)) == NULL) && (GET_PTR(SUCCP(ptr)) == NULL))
 	PUT_PTR(head_ptr, GET_PTR(SUCCP(ptr)));
     else if (GET_PTR(PREDP(ptr)) == NULL) {
@@ -483,7 +2088,15 @@ static void remove_block(void *ptr)
 	PUT_PTR(PREDPOFSUCC(ptr), GET_PTR(PREDP(ptr)));
 	PUT_PTR(SUCCPOFPRED(ptr), GET_PTR(SUCCP(ptr)));
     }
-	
+
+    /* The list became empty */
+    if (GET_PTR(head_ptr) == NULL) {
+	index = (head_ptr - first_listp) / WSIZE;
+	fl = index >> SUBCLASSBITS;
+	PUT(SL_BITMAPP(fl), GET(SL_BITMAPP(fl)) & ~(1 << (index & (NUMOFSUBCLASS - 1))));
+	if (GET(SL_BITMAPP(fl)) == 0)
+	    PUT(FL_BITMAPP, GET(FL_BITMAPP) & ~(1 << fl));
+    }
 }
 
 /*
@@ -505,24 +2118,70 @@ static void *split_block(void *ptr, size_t fsize, size_t lsize)
 }
 
 /*
- * get_listp - Calculate the appropriate head pointer for the given block according to the size class
+ * trim_block - Shrink the allocated block to the given size, and free the rest if it can be a block
  */
-static void *get_listp(size_t size)
+static void trim_block(void *ptr, size_t newsize)
+{
+    size_t oldsize = GET_SIZE(HDRP(ptr));
+    void *freeptr;
+
+    if ((oldsize - newsize) < MINBLOCKSIZE)
+	return;
+
+    freeptr = split_block(ptr, newsize, oldsize - newsize);
+
+    /* Mark the prev alloc tag into the next block */
+    PUT_PREV_ALLOC(HDRP(NEXT_BLKP(freeptr)), 0);
+    coalesce(freeptr);
+}
+
+/*
+ * get_index - Calculate the index of the size class for the given block size
+ * 	       Sizes in [2^k, 2^(k+1)) are split into NUMOFSUBCLASS classes by the SUBCLASSBITS bits
+ * 	       following the leading one, so the class is found with a count-leading-zeros instead of a loop.
+ */
+static int get_index(size_t size)
 {
-    int index = 0;
+    int fl;
 
-    if (size < SMALLESTSIZE) {		/* The first class */
-	return first_listp;
+    if (size < SMALLESTSIZE) {		/* The first classes, SMALLESTSIZE/NUMOFSUBCLASS bytes wide each */
+	return size >> (SMALLESTPOWEROFTWO - SUBCLASSBITS);
     }
     else if (size >= LARGESTSIZE) {	/* The last class */
-	return first_listp + ((NUMOFCLASS - 1)*WSIZE);
+	return NUMOFCLASS - 1;
     }
     else {
-	for (int i = SMALLESTSIZE; i < size; i *= 2) { 
-	    index++;
-	}
-    return first_listp + (index * WSIZE);
+	fl = FLS(size);
+	return ((fl - SMALLESTPOWEROFTWO + 1) << SUBCLASSBITS) + ((size >> (fl - SUBCLASSBITS)) & (NUMOFSUBCLASS - 1));
+    }
+}
+
+/*
+ * get_listp - Calculate the appropriate head pointer for the given block according to the size class
+ */
+static void *get_listp(size_t size)
+{
+    return first_listp + (get_index(size) * WSIZE);
+}
+
+/*
+ * find_class - Find the first non-empty class whose index is at least the given index using the bitmaps.
+ * 		Return -1 if there is no such class.
+ */
+static int find_class(int index)
+{
+    int fl = index >> SUBCLASSBITS;
+    size_t map = GET(SL_BITMAPP(fl)) & (~(size_t)0 << (index & (NUMOFSUBCLASS - 1)));
+
+    if (!map) {
+	/* No class left in this power of 2. Find the next non-empty power of 2 */
+	map = GET(FL_BITMAPP) & (~(size_t)0 << (fl + 1));
+	if (!map)
+	    return -1;
+	fl = FFS(map);
+	map = GET(SL_BITMAPP(fl));
     }
+    return (fl << SUBCLASSBITS) + FFS(map);
 }
 
 /*
@@ -533,9 +2192,9 @@ static void *extend_heap(size_t words)
     char *ptr;
     size_t size, prev_alloc;
 
-    /* Allocate an even number of words to maintain alignment */
-    size = (words % 2) ? (words+1) * WSIZE : words * WSIZE;
-    if ((long)(ptr = mem_sbrk(size)) == -1)
+    /* Allocate a multiple of ALIGNMENT bytes to maintain alignment */
+    size = ALIGN(words * WSIZE);
+    if ((long)(ptr = heap_sbrk(size)) == -1)
 	return NULL;
 
     /* Get prev alloc tag from old epilogue header */
@@ -552,23 +2211,117 @@ static void *extend_heap(size_t words)
 
 /*
  * find_fit - Find the free block which can hold the given size from the free list. 
- * 	      Use First fit manner.
+ * 	      With FIT_FIRST, the size is rounded up to the next class boundary, so the head of the first
+ * 	      non-empty class found through the bitmaps fits without any scan. Only when there is no such class
+ * 	      (or the size is in the last class), the class of the size itself is searched in first fit manner.
+ * 	      With the other policies, the class of the size is searched first, then the next non-empty class.
  */
 static void *find_fit(size_t newsize)
 {
-    /* First fit Search */
+    int index;
+#if FIT_POLICY == FIT_FIRST
     void *ptr;
+    size_t roundsize;
 
-    for (; head_ptr < (first_listp + (NUMOFCLASS * WSIZE)); head_ptr += WSIZE) {
-	for (ptr = GET_PTR(head_ptr); ptr != NULL; ptr = GET_PTR(SUCCP(ptr))) {
-	    if (newsize <= GET_SIZE(HDRP(ptr))) {
-	        return ptr;
-	    }
+    STAT_ADD(fit_calls, 1);
+
+    /* Good fit search through the bitmaps */
+    if (newsize < LARGESTSIZE) {
+	if (newsize < SMALLESTSIZE)
+	    roundsize = newsize + (SMALLESTSIZE/NUMOFSUBCLASS - 1);
+	else
+	    roundsize = newsize + (1 << (FLS(newsize) - SUBCLASSBITS)) - 1;
+
+	if ((index = find_class(get_index(roundsize))) >= 0) {
+	    STAT_ADD(fit_scanned, 1);
+	    head_ptr = first_listp + (index * WSIZE);
+	    return GET_PTR(head_ptr);
+	}
+    }
+
+    /* First fit search in the class of the size */
+    head_ptr = get_listp(newsize);
+    for (ptr = GET_PTR(head_ptr); ptr != NULL; ptr = GET_PTR(SUCCP(ptr))) {
+	STAT_ADD(fit_scanned, 1);
+	if (newsize <= GET_SIZE(HDRP(ptr))) {
+	    return ptr;
 	}
     }
     return NULL;
+#else
+    void *ptr;
+
+    STAT_ADD(fit_calls, 1);
+
+    index = get_index(newsize);
+    if ((ptr = scan_class(index, newsize)) != NULL)
+	return ptr;
+
+    /* Every block of a larger class fits */
+    if (index == NUMOFCLASS - 1 || (index = find_class(index + 1)) < 0)
+	return NULL;
+    return scan_class(index, newsize);
+#endif
 }
 
+#if FIT_POLICY != FIT_FIRST
+/*
+ * scan_class - Search the free list of the class for the given size according to FIT_POLICY
+ */
+static void *scan_class(int index, size_t newsize)
+{
+    char *ptr;
+#if FIT_POLICY == FIT_NEXT
+    char *rover;
+
+    head_ptr = first_listp + (index * WSIZE);
+    if ((rover = GET_PTR(ROVERP(index))) == NULL)
+	rover = GET_PTR(head_ptr);
+
+    /* From the rover to the tail, then from the head up to the rover.
+     * The rover is left at the block found; remove_block moves it on when the block is taken. */
+    for (ptr = rover; ptr != NULL; ptr = GET_PTR(SUCCP(ptr))) {
+	STAT_ADD(fit_scanned, 1);
+	if (newsize <= GET_SIZE(HDRP(ptr))) {
+	    PUT_PTR(ROVERP(index), ptr);
+	    return ptr;
+	}
+    }
+    for (ptr = GET_PTR(head_ptr); ptr != rover; ptr = GET_PTR(SUCCP(ptr))) {
+	STAT_ADD(fit_scanned, 1);
+	if (newsize <= GET_SIZE(HDRP(ptr))) {
+	    PUT_PTR(ROVERP(index), ptr);
+	    return ptr;
+	}
+    }
+    return NULL;
+#else
+    char *bestptr = NULL;
+    size_t size, bestsize = ~(size_t)0;
+#if FIT_POLICY == FIT_GOOD
+    int scanned = 0;
+#endif
+
+    head_ptr = first_listp + (index * WSIZE);
+    for (ptr = GET_PTR(head_ptr); ptr != NULL; ptr = GET_PTR(SUCCP(ptr))) {
+	STAT_ADD(fit_scanned, 1);
+	size = GET_SIZE(HDRP(ptr));
+	if (newsize <= size && size < bestsize) {
+	    bestptr = ptr;
+	    bestsize = size;
+	    /* Too close to split: no block fits better */
+	    if (size - newsize < MINBLOCKSIZE)
+		break;
+	}
+#if FIT_POLICY == FIT_GOOD
+	if (++scanned >= FIT_SCAN && bestptr != NULL)
+	    break;
+#endif
+    }
+    return bestptr;
+#endif
+}
+#endif
 
 /*
  * place - Place the given size to the given block.
@@ -581,7 +2334,7 @@ static void place(void *ptr, size_t newsize)
     size_t foundsize = GET_SIZE(HDRP(ptr));
    
     /* Case 1 : The size of free block need to be splited */
-    if ((foundsize - newsize) >= (2*SIZE_T_SIZE)) {
+    if ((foundsize - newsize) >= MINBLOCKSIZE) {
 	/* The former block is allocated */
 	remove_block(ptr);
 	ptr = split_block(ptr, newsize, foundsize-newsize);
@@ -598,16 +2351,70 @@ static void place(void *ptr, size_t newsize)
     }
 }
 
+#ifdef HEAPCHECK
 /*
  * mm_check - Heap checker. It scans the heap and checks it for consistency.
+ * 	      The free lists are walked first, marking their blocks in check_map, so the heap walk finds out
+ * 	      whether a free block is in a free list with a bit test and the whole check takes linear time.
  */
 static int mm_check(void)
 {
-    void *ptr, *search;
+    void *ptr;
     void *old_head = head_ptr;
+    int index;
+    long listed = 0;
+    size_t bit;
+
+    if (check_map == NULL) {
+	check_map = mmap(NULL, CHECK_MAPSIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (check_map == MAP_FAILED) {
+	    check_map = NULL;
+	    return 1;
+	}
+#ifdef ARENAS
+	pthread_once(&check_once, check_key_create);
+	pthread_setspecific(check_key, check_map);
+#endif
+    }
+    else
+	memset(check_map, 0, CHECK_MAPSIZE);
+
+    for (head_ptr = first_listp; head_ptr < (first_listp + (NUMOFCLASS * WSIZE)); head_ptr += WSIZE) {
+	for (ptr = GET_PTR(head_ptr); ptr != NULL; ptr = GET_PTR(SUCCP(ptr))) {
+	    bit = ((char *)ptr - first_listp) / ALIGNMENT;
+	    if ((char *)ptr < first_listp + HEAPSTART || bit >= CHECK_MAPSIZE*8) {
+		printf("Block [%p] in the free list is outside the heap\n", ptr);
+		return 0;
+	    }
+            /* 3) Check if every block in the free list is marked as free */
+	    if (GET_ALLOC(HDRP(ptr))) {
+		printf("Block [%p] is in the free list but isn't marked as free\n", ptr);
+		return 0;
+	    }
+	    /* 4) Check if every block is in the appropriate free list according to its size */
+	    if (get_listp(GET_SIZE(HDRP(ptr))) != head_ptr) {
+		printf("Block [%p] isn't in the appropriate free list\n", ptr);
+		return 0;
+	    }
+	    /* Mark the block. A block marked already is in the lists twice, or the list is a cycle */
+	    if ((check_map[bit >> 5] >> (bit & 31)) & 1) {
+		printf("Block [%p] is in the free lists more than once\n", ptr);
+		return 0;
+	    }
+	    check_map[bit >> 5] |= 1u << (bit & 31);
+	    listed++;
+	}
+	/* 5) Check if the bitmaps mark exactly the non-empty free lists */
+	index = (head_ptr - first_listp) / WSIZE;
+	if (((GET(SL_BITMAPP(index >> SUBCLASSBITS)) >> (index & (NUMOFSUBCLASS - 1))) & 1) != (GET_PTR(head_ptr) != NULL) ||
+	    ((GET(FL_BITMAPP) >> (index >> SUBCLASSBITS)) & 1) != (GET(SL_BITMAPP(index >> SUBCLASSBITS)) != 0)) {
+	    printf("Bitmaps disagree with free list [%d]\n", index);
+	    return 0;
+	}
+    }
 
     /* Scan the entire heap */
-    for(ptr = (first_listp + ((NUMOFCLASS + 2)*WSIZE)); GET_SIZE(HDRP(ptr)) > 0; ptr = NEXT_BLKP(ptr)) {
+    for(ptr = (first_listp + HEAPSTART); GET_SIZE(HDRP(ptr)) > 0; ptr = NEXT_BLKP(ptr)) {
         /* 1) Check if there are any contiguous free blocks that somehow escaped coalescing */
 	if ((GET_ALLOC(HDRP(ptr)) == 0) && (GET_ALLOC(HDRP(NEXT_BLKP(ptr))) == 0)) {
 	    printf("Block [%p] is not coalesced with next block [%p]\n", ptr, NEXT_BLKP(ptr));
@@ -615,33 +2422,141 @@ static int mm_check(void)
 	}
 	/* 2) Check if every free block is actually in the free list */
 	if (GET_ALLOC(HDRP(ptr)) == 0) {
-	    head_ptr = get_listp(GET_SIZE(HDRP(ptr)));
-	    search = GET_PTR(head_ptr);
-	    while (search != ptr) {
-		search = GET_PTR(SUCCP(search));
-		if (search == NULL) {
-		    printf("Block [%p] is free but it's not in the free list\n", ptr);
-		    return 0;
-		}
+	    bit = ((char *)ptr - first_listp) / ALIGNMENT;
+	    if (!((check_map[bit >> 5] >> (bit & 31)) & 1)) {
+		printf("Block [%p] is free but it's not in the free list\n", ptr);
+		return 0;
 	    }
+	    listed--;
 	}
     }
-    for (head_ptr = first_listp; head_ptr < (first_listp + (NUMOFCLASS * WSIZE)); head_ptr += WSIZE) {
-	for (ptr = GET_PTR(head_ptr); ptr != NULL; ptr = GET_PTR(SUCCP(ptr))) {
-            /* 3) Check if every block in the free list is marked as free */
-	    if (GET_ALLOC(HDRP(ptr))) {
-		printf("Block [%p] is in the free list but isn't marked as free\n", ptr);
+    /* Every block of the free lists was found in the heap */
+    if (listed != 0) {
+	printf("%ld blocks of the free lists are not blocks of the heap\n", listed);
+	return 0;
+    }
+
+#ifdef SLAB
+    /* 6) Check if every run with free objects is marked in the page map and counts its free objects right */
+    for (index = 0; index < SLAB_NUMCLASS; index++) {
+	for (struct run *run = (struct run *)GET_PTR(RUN_HEADP(index)); run != NULL; run = run->succ) {
+	    int numfree = 0;
+	    for (int i = 0; i < RUN_MAPWORDS; i++)
+		numfree += __builtin_popcount(run->map[i]);
+	    if (!IS_RUN(run) || run->class != index || run->numfree != numfree || numfree == 0) {
+		printf("Run [%p] is inconsistent with its run list [%d]\n", (void *)run, index);
 		return 0;
 	    }
-	    /* 4) Check if every block is in the appropriate free list according to its size */
-	    if (get_listp(GET_SIZE(HDRP(ptr))) != head_ptr) {
-		printf("Block [%p] isn't in the appropriate free list\n", ptr);
+	}
+    }
+#endif
+
+#ifdef QUICKLISTS
+    /* 7) Check if every block of a quick list is allocated, of the size of the list, and counted */
+    for (index = 0; index < QL_NUMCLASS; index++) {
+	unsigned int count = 0;
+	for (ptr = GET_PTR(QL_HEADP(index)); ptr != NULL && count <= QL_LIMIT; ptr = GET_PTR(ptr), count++) {
+	    if (!GET_ALLOC(HDRP(ptr)) || QL_INDEX(GET_SIZE(HDRP(ptr))) != (size_t)index) {
+		printf("Block [%p] is inconsistent with its quick list [%d]\n", ptr, index);
 		return 0;
 	    }
 	}
+	if (count != GET(QL_COUNTP(index))) {
+	    printf("Quick list [%d] holds %u blocks, not %u\n", index, count, GET(QL_COUNTP(index)));
+	    return 0;
+	}
     }
+#endif
 
     head_ptr = old_head;
 
     return 1;
 }
+
+#ifdef ARENAS
+static void check_key_create(void)
+{
+    pthread_key_create(&check_key, check_exit);
+}
+
+/*
+ * check_exit - Unmap the mm_check bitmap of the exiting thread
+ */
+static void check_exit(void *arg)
+{
+    munmap(arg, CHECK_MAPSIZE);
+}
+#endif
+
+/*
+ * check_step - Incremental heap checker, run after every operation. It checks the next CHECK_SLICE blocks
+ * 		from the cursor, wrapping around at the epilogue, and the whole heap every CHECK_PERIOD calls.
+ * 		Abort on the first inconsistency.
+ */
+static void check_step(void)
+{
+    char *ptr = GET_PTR(CHECK_CURSORP);
+    unsigned int count = GET(CHECK_COUNTP) + 1;
+    int ok = 1;
+
+    PUT(CHECK_COUNTP, count);
+    if (CHECK_PERIOD && count % CHECK_PERIOD == 0)
+	ok = mm_check();
+
+    if (ptr == NULL)
+	ptr = first_listp + HEAPSTART;
+    for (int i = 0; ok && i < CHECK_SLICE; i++) {
+	if (GET_SIZE(HDRP(ptr)) == 0)
+	    ptr = first_listp + HEAPSTART;
+	ok = check_block(ptr);
+	ptr = NEXT_BLKP(ptr);
+    }
+    PUT_PTR(CHECK_CURSORP, ptr);
+
+    if (!ok) {
+	fflush(stdout);
+	abort();
+    }
+}
+
+/*
+ * check_block - Check one block against its neighbors. A free block must have a matching footer,
+ * 		 be coalesced, and be linked into the list of its class in both directions.
+ */
+static int check_block(void *ptr)
+{
+    size_t size = GET_SIZE(HDRP(ptr));
+    char *predptr, *succptr;
+    int index = get_index(size);
+#ifdef ARENAS
+    char *brk = (cur_arena != &arenas[0]) ? cur_arena->brk : (char *)mem_heap_hi() + 1;
+#else
+    char *brk = (char *)mem_heap_hi() + 1;
+#endif
+
+    if (((size_t)ptr & (ALIGNMENT - 1)) || size < MINBLOCKSIZE || NEXT_BLKP(ptr) > brk) {
+	printf("Block [%p] has a bad size or alignment\n", ptr);
+	return 0;
+    }
+    if (GET_PREV_ALLOC(HDRP(NEXT_BLKP(ptr))) != GET_ALLOC(HDRP(ptr))) {
+	printf("Block [%p] disagrees with the prev alloc bit of the next block\n", ptr);
+	return 0;
+    }
+    if (GET_ALLOC(HDRP(ptr)))
+	return 1;
+
+    if (GET(FTRP(ptr)) != PACK_FTR(size, 0) || !GET_ALLOC(HDRP(NEXT_BLKP(ptr)))) {
+	printf("Block [%p] has a bad footer or is not coalesced\n", ptr);
+	return 0;
+    }
+    predptr = GET_PTR(PREDP(ptr));
+    succptr = GET_PTR(SUCCP(ptr));
+    if ((predptr == NULL ? GET_PTR(first_listp + index*WSIZE) != ptr : GET_PTR(SUCCP(predptr)) != ptr) ||
+	(succptr != NULL && GET_PTR(PREDP(succptr)) != ptr) ||
+	!((GET(SL_BITMAPP(index >> SUBCLASSBITS)) >> (index & (NUMOFSUBCLASS - 1))) & 1)) {
+	printf("Block [%p] is free but it's not linked into the free list\n", ptr);
+	return 0;
+    }
+    return 1;
+}
+#endif
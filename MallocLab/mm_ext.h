@@ -0,0 +1,87 @@
+/*
+ * mm_ext.h - Interfaces of mm.c beyond the ones declared in mm.h
+ */
+#ifndef MM_EXT_H
+#define MM_EXT_H
+
+#include <stddef.h>
+
+/* Number of payload bytes usable in the allocated block ptr */
+extern size_t mm_usable_size(void *ptr);
+
+/* Allocate a block whose payload is aligned to align (a power of 2) */
+extern void *mm_memalign(size_t align, size_t size);
+
+/* As mm_memalign, but NULL unless size is a multiple of align (C11 aligned_alloc) */
+extern void *mm_aligned_alloc(size_t align, size_t size);
+
+/* Allocate n blocks of size bytes into out and return how many were allocated (n unless out of memory) */
+extern size_t mm_malloc_batch(size_t size, size_t n, void **out);
+
+/* Free the n blocks of ptrs, skipping NULL; ptrs is sorted by address */
+extern void mm_free_batch(void **ptrs, size_t n);
+
+/* Bounds of a heap extension beyond the request and heap size fraction (1/2^shift) to grow by; call before mm_init */
+extern void mm_set_growth(size_t minchunk, size_t maxchunk, int shift);
+
+/* Size from which requests are mapped separately, when mm.c is built with -DMMAP_LARGE */
+extern void mm_set_mmap_threshold(size_t size);
+
+/* Total length of the separate mappings (0 without -DMMAP_LARGE) */
+extern size_t mm_mapped_bytes(void);
+
+/* Multiple heaps, available when mm.c is built with -DARENAS. After mm_init and mm_arena_init,
+ * every call must go through these functions; index is the arena the calling thread is bound to. */
+extern int mm_arena_init(int n);
+extern int mm_arena_of(void *ptr);
+extern void *mm_arena_malloc(int index, size_t size);
+extern void mm_arena_free(int index, void *ptr);
+extern void *mm_arena_realloc(int index, void *ptr, size_t size);
+
+/* Statistics, available when mm.c is built with -DMM_STATS */
+#define MM_NUMCLASS 53		/* Number of size classes of mm.c */
+
+struct mm_stats {
+    /* Counted since mm_init or mm_reset_stats */
+    unsigned long malloc_calls, free_calls, realloc_calls;
+    unsigned long class_allocs[MM_NUMCLASS];	/* mm_malloc calls by the size class of the request */
+    unsigned long class_frees[MM_NUMCLASS];	/* mm_free calls by the size class of the block */
+    unsigned long fit_calls;			/* Free list searches */
+    unsigned long fit_scanned;			/* Free blocks looked at by the searches */
+    unsigned long coalesce_cases[4];		/* Free blocks merged with none, the next, the previous, both */
+    unsigned long sbrk_calls;			/* Heap extensions */
+    unsigned long mapped_bytes;			/* Bytes mapped separately now (MMAP_LARGE) */
+    unsigned long quick_hits;			/* Requests served from a quick list (QUICKLISTS) */
+    unsigned long quick_flushes;		/* Quick lists coalesced */
+
+    /* Added up from the heap by mm_get_stats */
+    unsigned long heap_bytes;
+    unsigned long inuse_bytes;			/* Allocated blocks, headers included */
+    unsigned long free_bytes, free_blocks, largest_free;
+    double fragmentation;			/* 1 - largest_free / free_bytes */
+};
+
+extern void mm_get_stats(struct mm_stats *st);
+extern void mm_reset_stats(void);
+
+/* Binary trace of the mm_malloc, mm_free and mm_realloc calls, available when mm.c is built with
+ * -DMM_TRACE. The file is a sequence of these records; each thread buffers its own records, which are
+ * written out when the buffer is full, by mm_trace_flush, at thread exit and by mm_trace_close. */
+#define MM_TRACE_MALLOC	0
+#define MM_TRACE_FREE	1
+#define MM_TRACE_REALLOC	2
+
+struct mm_trace_event {
+    unsigned long long time;	/* Time stamp counter on x86, CLOCK_MONOTONIC ns elsewhere */
+    unsigned long long ptr;	/* Block returned, or freed */
+    unsigned long long oldptr;	/* Block given to mm_realloc */
+    unsigned long long size;	/* Size requested */
+    unsigned int op;		/* MM_TRACE_MALLOC, MM_TRACE_FREE or MM_TRACE_REALLOC */
+    unsigned int arena;		/* Arena the call was made in (ARENAS) */
+};
+
+extern int mm_trace_open(const char *path);
+extern void mm_trace_flush(void);
+extern void mm_trace_close(void);
+
+#endif
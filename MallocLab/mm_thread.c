@@ -0,0 +1,427 @@
+/*
+ * Thread Caching Front End
+ *
+ * mm.c keeps its state (first_listp, head_ptr and the heap itself) in globals without any locking,
+ * so it can only be called from one thread at a time. This front end makes it usable from
+ * multithreaded programs without serializing every call on one lock.
+ *
+ * Each thread owns a cache of free objects for the small size classes (TC_STEP bytes wide, up to
+ * TC_MAXSIZE bytes). Small requests are served from the thread cache without any synchronization.
+ * Objects move between the thread caches and the heap in batches of TC_BATCH objects:
+ *
+ *   - When a thread cache runs dry, it takes a batch from the central list of the class.
+ *     Only if the central list is empty, the heap lock is taken and TC_BATCH objects are carved from mm.c.
+ *   - When a thread cache holds more than TC_LIMIT objects of a class, it gives a batch back to the
+ *     central list. Only if the central list already holds CENTRAL_LIMIT batches, the batch is
+ *     returned to mm.c under the heap lock.
+ *
+ * The central lists are lock-free stacks of batches. The head word packs the pointer to the first
+ * batch with a tag that is incremented on every update, so that a pop racing with a pop and a push of
+ * the same batch fails its compare-and-swap instead of corrupting the list (ABA).
+ *
+ * Struct of a cached object (on the payload of an allocated mm.c block)
+ * ---------------------------------------------------------
+ * |			|			|		|
+ * | next object	| next batch		|   . . .	|
+ * | in the batch	| (first object only)	|		|
+ * ---------------------------------------------------------
+ *
+ * Large requests, and small ones in the rare refill/flush cases, go to mm.c under the heap lock.
+ *
+ * Built with ARENAS (together with mm.c), there is no single heap lock: mmt_init creates one arena
+ * per CPU and each thread goes to the arena of the CPU it runs on, looked up again every
+ * ARENA_REBIND refills. Blocks are freed to their owner arena through its remote-free list.
+ */
+#ifdef ARENAS
+#define _GNU_SOURCE	/* sched_getcpu */
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+#ifdef ARENAS
+#include <sched.h>
+#include <unistd.h>
+#endif
+
+#include "mm.h"
+#include "mm_ext.h"
+#include "mm_thread.h"
+
+/* Variables for the thread caches */
+#define TC_STEP 16				/* Width of a small size class (bytes) */
+#define TC_NUMCLASS 32				/* Number of small size classes */
+#define TC_MAXSIZE (TC_STEP*TC_NUMCLASS)	/* Largest request served by the thread caches */
+#define TC_BATCH 32				/* Objects moved between a thread cache and a central list at once */
+#define TC_LIMIT (2*TC_BATCH)			/* A thread cache gives back a batch above this count */
+#define CENTRAL_LIMIT 64			/* Batches kept in a central list before going back to mm.c */
+
+/* Read and write the links of a cached object */
+#define NEXT_OBJ(p)		(((void **)(p))[0])
+#define NEXT_BATCH(p)		(((void **)(p))[1])
+
+/* Pack and unpack the pointer and the ABA tag of a central list head */
+#if UINTPTR_MAX > 0xffffffffUL
+#define TAG_SHIFT 48
+#else
+#define TAG_SHIFT 32
+#endif
+#define TAG_PTR(v)		((void *)(uintptr_t)((v) & (((uint64_t)1 << TAG_SHIFT) - 1)))
+#define TAG_PACK(ptr, old)	((uint64_t)(uintptr_t)(ptr) | ((((old) >> TAG_SHIFT) + 1) << TAG_SHIFT))
+
+/* Structure for the cache of one thread */
+struct tcache {
+    void *head[TC_NUMCLASS];
+    int count[TC_NUMCLASS];
+};
+
+static __thread struct tcache tcache;
+
+/* Central lists of batches for each small size class, and the number of batches in them */
+static uint64_t central[TC_NUMCLASS];
+static int central_count[TC_NUMCLASS];
+
+#ifdef ARENAS
+#define ARENA_REBIND 64				/* Refills between two lookups of the thread's CPU */
+
+static int numofarena = 1;
+
+/* The arena of the thread, and the refills left until it is looked up again */
+static __thread int thread_arena = -1;
+static __thread int rebind = 0;
+#else
+/* Serializes every call into mm.c */
+static pthread_mutex_t heap_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+/* Registers tcache_flush to run when a thread exits */
+static pthread_key_t tcache_key;
+
+static int push_batch(int class, void *batch);
+static void *pop_batch(int class);
+static int refill(int class);
+static void flush(int class, int n);
+static void tcache_flush(void *arg);
+static void register_tcache(struct tcache *tc);
+static void *heap_malloc(size_t size);
+static void heap_free(void *ptr);
+static void *heap_realloc(void *ptr, size_t size);
+#ifdef ARENAS
+static void bind_arena(void);
+#endif
+
+/*
+ * mmt_init - Initialize mm.c and the front end. Must be called once before any other mmt_ function.
+ */
+int mmt_init(void)
+{
+    int ret;
+
+    if (pthread_key_create(&tcache_key, tcache_flush) != 0)
+	return -1;
+
+#ifdef ARENAS
+    if ((ret = mm_init()) == 0) {
+	long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+	numofarena = mm_arena_init(ncpu > 0 ? (int)ncpu : 1);
+    }
+#else
+    pthread_mutex_lock(&heap_lock);
+    ret = mm_init();
+    pthread_mutex_unlock(&heap_lock);
+#endif
+
+    return ret;
+}
+
+/*
+ * mmt_malloc - Allocate from the thread cache for small sizes, or from mm.c under the heap lock.
+ */
+void *mmt_malloc(size_t size)
+{
+    struct tcache *tc = &tcache;
+    void *ptr;
+    int class;
+
+    /* Ignore spurious requests */
+    if (size == 0)
+	return NULL;
+
+    if (size > TC_MAXSIZE)
+	return heap_malloc(size);
+
+    class = (size - 1) / TC_STEP;
+    if (tc->head[class] == NULL && !refill(class))
+	return NULL;
+
+    ptr = tc->head[class];
+    tc->head[class] = NEXT_OBJ(ptr);
+    tc->count[class]--;
+
+    return ptr;
+}
+
+/*
+ * mmt_free - Free the block into the thread cache of its class, or to mm.c for large blocks.
+ */
+void mmt_free(void *ptr)
+{
+    struct tcache *tc = &tcache;
+    int class;
+
+    if (ptr == NULL)
+	return;
+
+    /* The size bits of the header of an allocated block never change, so they can be read without the lock */
+    class = (int)(mm_usable_size(ptr) / TC_STEP) - 1;
+    if (class < 0 || class >= TC_NUMCLASS) {
+	heap_free(ptr);
+	return;
+    }
+
+    /* So does the first free into an empty class, for threads that only free */
+    if (tc->count[class] == 0)
+	register_tcache(tc);
+
+    NEXT_OBJ(ptr) = tc->head[class];
+    tc->head[class] = ptr;
+    if (++tc->count[class] > TC_LIMIT)
+	flush(class, TC_BATCH);
+}
+
+/*
+ * mmt_realloc - Keep the block if it is still large enough and not more than twice the size,
+ * 		 let mm_realloc grow large blocks in place, and otherwise copy.
+ */
+void *mmt_realloc(void *ptr, size_t size)
+{
+    void *newptr;
+    size_t oldsize;
+
+    if (ptr == NULL)
+	return mmt_malloc(size);
+    if (size == 0) {
+	mmt_free(ptr);
+	return NULL;
+    }
+
+    oldsize = mm_usable_size(ptr);
+    if (size <= oldsize && size > oldsize / 2)
+	return ptr;
+
+    /* Neither the old nor the new block belongs to a thread cache */
+    if (oldsize >= (TC_NUMCLASS + 1)*TC_STEP && size > TC_MAXSIZE)
+	return heap_realloc(ptr, size);
+
+    if ((newptr = mmt_malloc(size)) == NULL)
+	return NULL;
+    memcpy(newptr, ptr, (size < oldsize) ? size : oldsize);
+    mmt_free(ptr);
+
+    return newptr;
+}
+
+/*
+ * push_batch - Push a batch of TC_BATCH objects to the central list of the class.
+ * 		Return 0 without pushing if the central list is already full.
+ */
+static int push_batch(int class, void *batch)
+{
+    uint64_t old;
+
+    if (__atomic_load_n(&central_count[class], __ATOMIC_RELAXED) >= CENTRAL_LIMIT)
+	return 0;
+
+    old = __atomic_load_n(&central[class], __ATOMIC_RELAXED);
+    do {
+	NEXT_BATCH(batch) = TAG_PTR(old);
+    } while (!__atomic_compare_exchange_n(&central[class], &old, TAG_PACK(batch, old), 1,
+					  __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+    __atomic_add_fetch(&central_count[class], 1, __ATOMIC_RELAXED);
+
+    return 1;
+}
+
+/*
+ * pop_batch - Pop a batch from the central list of the class, or return NULL if it is empty.
+ * 	       NEXT_BATCH of a batch may be read after another thread took it; the tag makes the
+ * 	       compare-and-swap fail in that case, and the heap memory stays mapped, so the read is harmless.
+ */
+static void *pop_batch(int class)
+{
+    uint64_t old;
+    void *batch;
+
+    old = __atomic_load_n(&central[class], __ATOMIC_ACQUIRE);
+    do {
+	if ((batch = TAG_PTR(old)) == NULL)
+	    return NULL;
+    } while (!__atomic_compare_exchange_n(&central[class], &old, TAG_PACK(NEXT_BATCH(batch), old), 1,
+					  __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE));
+    __atomic_sub_fetch(&central_count[class], 1, __ATOMIC_RELAXED);
+
+    return batch;
+}
+
+/*
+ * register_tcache - Have the thread cache flushed when the thread exits
+ */
+static void register_tcache(struct tcache *tc)
+{
+    if (pthread_getspecific(tcache_key) == NULL)
+	pthread_setspecific(tcache_key, tc);
+}
+
+/*
+ * refill - Fill the empty thread cache of the class with a batch, from the central list if possible,
+ * 	    otherwise from mm.c. Return the number of objects obtained.
+ */
+static int refill(int class)
+{
+    struct tcache *tc = &tcache;
+    void *ptr;
+    int n;
+
+    /* The first refill of a thread registers the cache to be flushed at thread exit */
+    register_tcache(tc);
+
+    if ((ptr = pop_batch(class)) != NULL) {
+	tc->head[class] = ptr;
+	tc->count[class] = TC_BATCH;
+	return TC_BATCH;
+    }
+
+#ifdef ARENAS
+    if (--rebind <= 0)
+	bind_arena();
+    for (n = 0; n < TC_BATCH; n++) {
+	if ((ptr = mm_arena_malloc(thread_arena, (class + 1) * TC_STEP)) == NULL)
+	    break;
+#else
+    pthread_mutex_lock(&heap_lock);
+    for (n = 0; n < TC_BATCH; n++) {
+	if ((ptr = mm_malloc((class + 1) * TC_STEP)) == NULL)
+	    break;
+#endif
+	NEXT_OBJ(ptr) = tc->head[class];
+	tc->head[class] = ptr;
+    }
+#ifndef ARENAS
+    pthread_mutex_unlock(&heap_lock);
+#endif
+    tc->count[class] = n;
+
+    return n;
+}
+
+/*
+ * flush - Move n objects from the thread cache of the class to the central list as one batch,
+ * 	   or back to mm.c if n isn't a full batch or the central list is full.
+ */
+static void flush(int class, int n)
+{
+    struct tcache *tc = &tcache;
+    void *batch, *last, *ptr;
+    int i;
+
+    batch = last = tc->head[class];
+    for (i = 1; i < n; i++)
+	last = NEXT_OBJ(last);
+    tc->head[class] = NEXT_OBJ(last);
+    tc->count[class] -= n;
+    NEXT_OBJ(last) = NULL;
+
+    if (n == TC_BATCH && push_batch(class, batch))
+	return;
+
+#ifndef ARENAS
+    pthread_mutex_lock(&heap_lock);
+#endif
+    while (batch != NULL) {
+	ptr = batch;
+	batch = NEXT_OBJ(batch);
+#ifdef ARENAS
+	mm_arena_free(thread_arena < 0 ? 0 : thread_arena, ptr);
+#else
+	mm_free(ptr);
+#endif
+    }
+#ifndef ARENAS
+    pthread_mutex_unlock(&heap_lock);
+#endif
+}
+
+/*
+ * tcache_flush - Give every object of the exiting thread's cache back
+ */
+static void tcache_flush(void *arg)
+{
+    struct tcache *tc = arg;
+    int class;
+
+    for (class = 0; class < TC_NUMCLASS; class++) {
+	while (tc->count[class] >= TC_BATCH)
+	    flush(class, TC_BATCH);
+	if (tc->count[class] > 0)
+	    flush(class, tc->count[class]);
+    }
+}
+
+#ifdef ARENAS
+/*
+ * bind_arena - Bind the thread to the arena of the CPU it runs on
+ */
+static void bind_arena(void)
+{
+    int cpu = sched_getcpu();
+
+    thread_arena = (cpu < 0 ? 0 : cpu) % numofarena;
+    rebind = ARENA_REBIND;
+}
+#endif
+
+/*
+ * heap_malloc, heap_free, heap_realloc - Call mm.c for a block that bypasses the thread caches,
+ * 					  in the arena of the thread or under the heap lock.
+ */
+static void *heap_malloc(size_t size)
+{
+#ifdef ARENAS
+    if (thread_arena < 0)
+	bind_arena();
+    return mm_arena_malloc(thread_arena, size);
+#else
+    void *ptr;
+
+    pthread_mutex_lock(&heap_lock);
+    ptr = mm_malloc(size);
+    pthread_mutex_unlock(&heap_lock);
+    return ptr;
+#endif
+}
+
+static void heap_free(void *ptr)
+{
+#ifdef ARENAS
+    mm_arena_free(thread_arena < 0 ? 0 : thread_arena, ptr);
+#else
+    pthread_mutex_lock(&heap_lock);
+    mm_free(ptr);
+    pthread_mutex_unlock(&heap_lock);
+#endif
+}
+
+static void *heap_realloc(void *ptr, size_t size)
+{
+#ifdef ARENAS
+    return mm_arena_realloc(thread_arena < 0 ? 0 : thread_arena, ptr, size);
+#else
+    void *newptr;
+
+    pthread_mutex_lock(&heap_lock);
+    newptr = mm_realloc(ptr, size);
+    pthread_mutex_unlock(&heap_lock);
+    return newptr;
+#endif
+}
@@ -0,0 +1,14 @@
+/*
+ * mm_thread.h - Thread-safe front end with per-thread caches over mm.c
+ */
+#ifndef MM_THREAD_H
+#define MM_THREAD_H
+
+#include <stddef.h>
+
+extern int mmt_init(void);
+extern void *mmt_malloc(size_t size);
+extern void mmt_free(void *ptr);
+extern void *mmt_realloc(void *ptr, size_t size);
+
+#endif
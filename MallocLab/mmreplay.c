@@ -0,0 +1,627 @@
+/*
+ * mmreplay.c - Replay allocation traces against mm.c and glibc malloc
+ *
+ * The lab driver scores mm.c by average utilization and throughput only.
+ * This tool loads each trace into memory first and then replays it, timing
+ * every call with the time stamp counter. For every (trace, allocator) it
+ * reports the throughput, the peak utilization (peak payload bytes in use
+ * over the peak heap footprint), and the p50/p99/p99.9/max latency of the
+ * malloc, free and realloc calls from log-linear histograms in the style of
+ * HdrHistogram (HIST_SUBBITS bits of precision, about 3%).
+ *
+ * Two trace formats are read:
+ *
+ *   *.rep	    the text traces of the lab driver: a header of heap size,
+ *		    number of ids, number of ops and weight, then one
+ *		    "a <id> <size>", "r <id> <size>" or "f <id>" per line
+ *   any other	    the binary traces mm.c writes when built with -DMM_TRACE;
+ *		    the records are ordered by time and the pointers are
+ *		    turned into ids
+ *
+ * The footprint of mm.c is mem_heapsize() plus the mappings of large blocks;
+ * that of glibc is the arena and mapped bytes of mallinfo2() less what they
+ * were before the first replay, read whenever the payload in use reaches a
+ * new peak (outside the timed calls). The tool's own memory is mapped with
+ * mmap, so glibc serves nothing but the trace, and glibc replays each trace
+ * in a child process, so it starts from the same heap for every trace. The
+ * utilization reported is that of the first run.
+ *
+ * Build: gcc -O2 -o mmreplay mmreplay.c mm.c memlib.c
+ * Usage: ./mmreplay [-a mm|libc|both] [-n <runs>] <trace>...
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <malloc.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include "mm.h"
+#include "mm_ext.h"
+#include "memlib.h"
+
+#define HIST_SUBBITS 5				/* Sub-buckets per power of 2: 2^HIST_SUBBITS */
+#define HIST_SUBCOUNT (1 << HIST_SUBBITS)
+#define HIST_BUCKETS (64 * HIST_SUBCOUNT)
+
+enum optype { OP_ALLOC, OP_FREE, OP_REALLOC, NUMOPTYPES };
+static const char *op_name[] = { "malloc", "free", "realloc" };
+
+/* Structure for one operation of a trace */
+struct op {
+	enum optype type;
+	int id;
+	size_t size;
+};
+
+/* Structure for a trace loaded into memory */
+struct trace {
+	const char *name;
+	struct op *ops;
+	size_t opsbytes;
+	int numops, numids;
+};
+
+/* Structure for an allocator under test */
+struct allocator {
+	const char *name;
+	int (*init)(void);
+	void *(*malloc)(size_t size);
+	void (*free)(void *ptr);
+	void *(*realloc)(void *ptr, size_t size);
+	size_t (*footprint)(void);
+};
+
+/* Structure for a log-linear latency histogram, in time stamp counter ticks */
+struct hist {
+	unsigned long count[HIST_BUCKETS];
+	unsigned long total, max;
+};
+
+static double ticks_per_ns = 1.0;
+
+/* glibc footprint before the first replay of the process (stdio buffers) */
+static size_t libc_base = 0;
+
+/* Zeroed memory for the tool itself, outside glibc's heap. Return NULL on error */
+static void *map_alloc(size_t size)
+{
+	void *ptr = mmap(NULL, size ? size : 1, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+	return (ptr == MAP_FAILED) ? NULL : ptr;
+}
+
+static void map_free(void *ptr, size_t size)
+{
+	if (ptr != NULL)
+		munmap(ptr, size ? size : 1);
+}
+
+/*
+ * Time stamp counter, or CLOCK_MONOTONIC in ns where there is none
+ */
+static inline unsigned long long ticks(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	return __builtin_ia32_rdtsc();
+#else
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+#endif
+}
+
+static long elapsed_ns(struct timespec *t0, struct timespec *t1)
+{
+	return (t1->tv_sec - t0->tv_sec) * 1000000000L + (t1->tv_nsec - t0->tv_nsec);
+}
+
+/* Measure the time stamp counter rate against CLOCK_MONOTONIC over 50ms */
+static void calibrate(void)
+{
+	struct timespec t0, t1;
+	unsigned long long c0, c1;
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	c0 = ticks();
+	do {
+		clock_gettime(CLOCK_MONOTONIC, &t1);
+	} while (elapsed_ns(&t0, &t1) < 50000000L);
+	c1 = ticks();
+	ticks_per_ns = (double)(c1 - c0) / elapsed_ns(&t0, &t1);
+}
+
+/*
+ * Histogram buckets: values below HIST_SUBCOUNT have a bucket each, and every
+ * power of 2 above is split into HIST_SUBCOUNT buckets of equal width.
+ */
+static int hist_index(unsigned long v)
+{
+	int e;
+
+	if (v < HIST_SUBCOUNT)
+		return v;
+	e = (63 - __builtin_clzl(v)) - HIST_SUBBITS;
+	return (e + 1) * HIST_SUBCOUNT + (int)((v >> e) - HIST_SUBCOUNT);
+}
+
+/* Highest value of a bucket */
+static unsigned long hist_value(int index)
+{
+	int e;
+
+	if (index < HIST_SUBCOUNT)
+		return index;
+	e = index / HIST_SUBCOUNT - 1;
+	return (((unsigned long)(index % HIST_SUBCOUNT + HIST_SUBCOUNT) + 1) << e) - 1;
+}
+
+static void hist_add(struct hist *h, unsigned long v)
+{
+	h->count[hist_index(v)]++;
+	h->total++;
+	if (v > h->max)
+		h->max = v;
+}
+
+/* Value at the given quantile (0..1), in ns */
+static double hist_quantile(struct hist *h, double q)
+{
+	unsigned long rank = (unsigned long)(q * h->total), seen = 0;
+	int i;
+
+	for (i = 0; i < HIST_BUCKETS; i++) {
+		seen += h->count[i];
+		if (seen > rank)
+			return hist_value(i) / ticks_per_ns;
+	}
+	return h->max / ticks_per_ns;
+}
+
+/* Load a lab driver trace. Return 0, or -1 on error */
+static int load_rep(FILE *fp, struct trace *t)
+{
+	char type;
+	int heapsize, weight, i;
+	unsigned long size;
+
+	if (fscanf(fp, "%d %d %d %d", &heapsize, &t->numids, &t->numops, &weight) != 4 ||
+	    t->numids <= 0 || t->numops < 0)
+		return -1;
+	t->opsbytes = sizeof(struct op) * t->numops;
+	if ((t->ops = map_alloc(t->opsbytes)) == NULL)
+		return -1;
+
+	for (i = 0; i < t->numops; i++) {
+		if (fscanf(fp, " %c %d", &type, &t->ops[i].id) != 2 || t->ops[i].id < 0 || t->ops[i].id >= t->numids)
+			return -1;
+		switch (type) {
+		case 'a':
+		case 'r':
+			if (fscanf(fp, "%lu", &size) != 1)
+				return -1;
+			t->ops[i].type = (type == 'a') ? OP_ALLOC : OP_REALLOC;
+			t->ops[i].size = size;
+			break;
+		case 'f':
+			t->ops[i].type = OP_FREE;
+			t->ops[i].size = 0;
+			break;
+		default:
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Sort the events by time, keeping the file order of equal times. A merge
+ * sort, since qsort may allocate through glibc.
+ */
+static int sort_events(struct mm_trace_event *ev, size_t n)
+{
+	struct mm_trace_event *tmp, *src = ev, *dst, *swap;
+	size_t width, lo, mid, hi, i, j, k;
+
+	if ((tmp = dst = map_alloc(n * sizeof(*ev))) == NULL)
+		return -1;
+	for (width = 1; width < n; width *= 2) {
+		for (lo = 0; lo < n; lo += 2 * width) {
+			mid = (lo + width < n) ? lo + width : n;
+			hi = (lo + 2 * width < n) ? lo + 2 * width : n;
+			for (i = lo, j = mid, k = lo; k < hi; k++)
+				dst[k] = (j == hi || (i < mid && src[i].time <= src[j].time)) ? src[i++] : src[j++];
+		}
+		swap = src;
+		src = dst;
+		dst = swap;
+	}
+	if (src != ev)
+		memcpy(ev, src, n * sizeof(*ev));
+	map_free(tmp, n * sizeof(*ev));
+	return 0;
+}
+
+/* Open addressing map from a block address to its id */
+struct idmap {
+	unsigned long long *key;
+	int *id;
+	size_t mask;
+};
+
+static size_t idmap_slot(struct idmap *m, unsigned long long key)
+{
+	size_t i = (size_t)((key >> 4) * 0x9E3779B97F4A7C15ULL) & m->mask;
+
+	while (m->key[i] != 0 && m->key[i] != key)
+		i = (i + 1) & m->mask;
+	return i;
+}
+
+/* Delete a slot and move the entries behind it that would no longer be found */
+static void idmap_delete(struct idmap *m, size_t i)
+{
+	size_t j = i, home;
+
+	m->key[i] = 0;
+	for (;;) {
+		j = (j + 1) & m->mask;
+		if (m->key[j] == 0)
+			return;
+		home = (size_t)((m->key[j] >> 4) * 0x9E3779B97F4A7C15ULL) & m->mask;
+		if ((j > i && (home <= i || home > j)) || (j < i && home <= i && home > j)) {
+			m->key[i] = m->key[j];
+			m->id[i] = m->id[j];
+			m->key[j] = 0;
+			i = j;
+		}
+	}
+}
+
+/*
+ * Load an MM_TRACE trace. Every block gets a new id when it is allocated;
+ * frees of blocks the trace never allocated are dropped.
+ */
+static int load_bin(FILE *fp, struct trace *t)
+{
+	struct mm_trace_event *ev = NULL, *old;
+	struct idmap map;
+	size_t n = 0, cap = 0, i, slot, mapsize;
+	int id;
+
+	for (;;) {
+		if (n == cap) {
+			old = ev;
+			if ((ev = map_alloc((cap ? 2 * cap : 4096) * sizeof(*ev))) == NULL)
+				return -1;
+			memcpy(ev, old, n * sizeof(*ev));
+			map_free(old, cap * sizeof(*ev));
+			cap = cap ? 2 * cap : 4096;
+		}
+		if (fread(&ev[n], sizeof(*ev), 1, fp) != 1)
+			break;
+		n++;
+	}
+	if (sort_events(ev, n) < 0)
+		return -1;
+
+	for (mapsize = 1; mapsize < 2 * n; mapsize <<= 1)
+		;
+	map.key = map_alloc(mapsize * sizeof(*map.key));
+	map.id = map_alloc(mapsize * sizeof(*map.id));
+	t->opsbytes = sizeof(struct op) * n;
+	t->ops = map_alloc(t->opsbytes);
+	if (map.key == NULL || map.id == NULL || t->ops == NULL)
+		return -1;
+	map.mask = mapsize - 1;
+	t->numops = t->numids = 0;
+
+	for (i = 0; i < n; i++) {
+		struct op *op = &t->ops[t->numops];
+
+		if (ev[i].op == MM_TRACE_REALLOC && ev[i].oldptr == 0)
+			ev[i].op = MM_TRACE_MALLOC;
+
+		if (ev[i].op == MM_TRACE_MALLOC) {
+			if (ev[i].ptr == 0)
+				continue;
+			slot = idmap_slot(&map, ev[i].ptr);
+			map.key[slot] = ev[i].ptr;
+			map.id[slot] = t->numids;
+			op->type = OP_ALLOC;
+			op->id = t->numids++;
+			op->size = ev[i].size;
+			t->numops++;
+			continue;
+		}
+
+		slot = idmap_slot(&map, ev[i].op == MM_TRACE_FREE ? ev[i].ptr : ev[i].oldptr);
+		if (map.key[slot] == 0)
+			continue;
+		id = map.id[slot];
+		if (ev[i].op == MM_TRACE_FREE || ev[i].size == 0) {
+			idmap_delete(&map, slot);
+			op->type = OP_FREE;
+			op->size = 0;
+		}
+		else {
+			if (ev[i].ptr == 0)
+				continue;
+			idmap_delete(&map, slot);
+			slot = idmap_slot(&map, ev[i].ptr);
+			map.key[slot] = ev[i].ptr;
+			map.id[slot] = id;
+			op->type = OP_REALLOC;
+			op->size = ev[i].size;
+		}
+		op->id = id;
+		t->numops++;
+	}
+
+	map_free(ev, cap * sizeof(*ev));
+	map_free(map.key, mapsize * sizeof(*map.key));
+	map_free(map.id, mapsize * sizeof(*map.id));
+	if (t->numids == 0)
+		t->numids = 1;
+	return 0;
+}
+
+static int load_trace(const char *path, struct trace *t)
+{
+	size_t len = strlen(path);
+	FILE *fp;
+	int ret;
+
+	t->name = strrchr(path, '/') ? strrchr(path, '/') + 1 : path;
+	if ((fp = fopen(path, "r")) == NULL) {
+		perror(path);
+		return -1;
+	}
+	if (len > 4 && strcmp(path + len - 4, ".rep") == 0)
+		ret = load_rep(fp, t);
+	else
+		ret = load_bin(fp, t);
+	fclose(fp);
+
+	if (ret < 0)
+		fprintf(stderr, "mmreplay: bad trace %s\n", path);
+	return ret;
+}
+
+static size_t libc_bytes(void)
+{
+	struct mallinfo2 mi = mallinfo2();
+
+	return mi.arena + mi.hblkhd;
+}
+
+static int libc_init(void)
+{
+	static int first = 1;
+
+	if (first) {
+		libc_base = libc_bytes();
+		first = 0;
+	}
+	return 0;
+}
+
+static size_t libc_footprint(void)
+{
+	size_t bytes = libc_bytes();
+
+	return (bytes > libc_base) ? bytes - libc_base : 0;
+}
+
+static int mm_reinit(void)
+{
+	mem_reset_brk();
+	return mm_init();
+}
+
+static size_t mm_footprint(void)
+{
+	return mem_heapsize() + mm_mapped_bytes();
+}
+
+static struct allocator allocators[] = {
+	{ "mm", mm_reinit, mm_malloc, mm_free, mm_realloc, mm_footprint },
+	{ "libc", libc_init, malloc, free, realloc, libc_footprint },
+};
+#define NUMALLOCATORS (sizeof(allocators) / sizeof(allocators[0]))
+
+/*
+ * Replay the trace once, adding the latencies to the histograms. Return the
+ * sum of the latencies in ticks, or 0 if the allocator ran out of memory.
+ * The peak utilization is stored in *util.
+ */
+static unsigned long long replay(struct allocator *a, struct trace *t, struct hist *hist, double *util)
+{
+	void **blocks = map_alloc(t->numids * sizeof(void *));
+	size_t *sizes = map_alloc(t->numids * sizeof(size_t));
+	size_t live = 0, peak = 0, footprint, peakfoot = 0;
+	unsigned long long c0, c1, total = 0;
+	struct op *op;
+	void *ptr;
+	int i, ok = 1;
+
+	if (blocks == NULL || sizes == NULL || a->init() < 0) {
+		map_free(blocks, t->numids * sizeof(void *));
+		map_free(sizes, t->numids * sizeof(size_t));
+		return 0;
+	}
+
+	for (i = 0; i < t->numops && ok; i++) {
+		op = &t->ops[i];
+		switch (op->type) {
+		case OP_ALLOC:
+			c0 = ticks();
+			ptr = a->malloc(op->size);
+			c1 = ticks();
+			if (ptr == NULL && op->size > 0) {
+				ok = 0;
+				break;
+			}
+			blocks[op->id] = ptr;
+			live += sizes[op->id] = op->size;
+			break;
+		case OP_REALLOC:
+			c0 = ticks();
+			ptr = a->realloc(blocks[op->id], op->size);
+			c1 = ticks();
+			if (ptr == NULL && op->size > 0) {
+				ok = 0;
+				break;
+			}
+			blocks[op->id] = ptr;
+			live += op->size - sizes[op->id];
+			sizes[op->id] = op->size;
+			break;
+		case OP_FREE:
+		default:
+			c0 = ticks();
+			if (blocks[op->id] != NULL)
+				a->free(blocks[op->id]);
+			c1 = ticks();
+			blocks[op->id] = NULL;
+			live -= sizes[op->id];
+			sizes[op->id] = 0;
+			break;
+		}
+		if (!ok)
+			break;
+
+		/* Touch the block as a program would, outside the timed call */
+		if (op->type != OP_FREE && op->size > 0) {
+			((char *)blocks[op->id])[0] = 1;
+			((char *)blocks[op->id])[op->size - 1] = 1;
+		}
+
+		hist_add(&hist[op->type], c1 - c0);
+		total += c1 - c0;
+		if (live > peak) {
+			peak = live;
+			if ((footprint = a->footprint()) > peakfoot)
+				peakfoot = footprint;
+		}
+	}
+
+	if ((footprint = a->footprint()) > peakfoot)
+		peakfoot = footprint;
+	*util = peakfoot ? (double)peak / peakfoot : 0.0;
+
+	/* glibc keeps its blocks across runs, and so do the mappings of mm.c; give them back */
+	for (i = 0; i < t->numids; i++) {
+		if (blocks[i] != NULL)
+			a->free(blocks[i]);
+	}
+	map_free(blocks, t->numids * sizeof(void *));
+	map_free(sizes, t->numids * sizeof(size_t));
+	return ok ? (total ? total : 1) : 0;
+}
+
+/* Replay the trace runs times against the allocator and print a result block */
+static int bench(struct allocator *a, struct trace *t, int runs)
+{
+	struct hist *hist = map_alloc(NUMOPTYPES * sizeof(struct hist));
+	unsigned long long total, best = 0;
+	double util = 0.0, runutil;
+	int r, i;
+
+	if (hist == NULL)
+		return -1;
+	for (r = 0; r < runs; r++) {
+		/* The utilization of the first run, from a heap no earlier run grew */
+		if ((total = replay(a, t, hist, r == 0 ? &util : &runutil)) == 0) {
+			printf("%-24s %-5s out of memory\n", t->name, a->name);
+			map_free(hist, NUMOPTYPES * sizeof(struct hist));
+			return -1;
+		}
+		if (best == 0 || total < best)
+			best = total;
+	}
+
+	printf("%-24s %-5s ops=%-8d %10.0f Kops/s  util=%.3f\n", t->name, a->name, t->numops,
+	       t->numops / (best / ticks_per_ns) * 1e6, util);
+	for (i = 0; i < NUMOPTYPES; i++) {
+		if (hist[i].total == 0)
+			continue;
+		printf("    %-8s n=%-9lu p50=%8.0f ns  p99=%8.0f ns  p99.9=%8.0f ns  max=%10.0f ns\n",
+		       op_name[i], hist[i].total, hist_quantile(&hist[i], 0.5), hist_quantile(&hist[i], 0.99),
+		       hist_quantile(&hist[i], 0.999), hist[i].max / ticks_per_ns);
+	}
+
+	map_free(hist, NUMOPTYPES * sizeof(struct hist));
+	return 0;
+}
+
+/* bench in a child process, whose glibc heap the traces replayed before never grew */
+static int bench_forked(struct allocator *a, struct trace *t, int runs)
+{
+	pid_t pid;
+	int status;
+
+	fflush(stdout);
+	if ((pid = fork()) < 0)
+		return bench(a, t, runs);
+	if (pid == 0) {
+		status = bench(a, t, runs);
+		fflush(stdout);
+		_exit(status < 0);
+	}
+	if (waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+		return -1;
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	struct trace t;
+	const char *which = "both";
+	int opt, runs = 3, ret = 0;
+	unsigned i;
+
+	while ((opt = getopt(argc, argv, "a:n:")) != -1) {
+		switch (opt) {
+		case 'a':
+			which = optarg;
+			break;
+		case 'n':
+			runs = atoi(optarg);
+			break;
+		default:
+			fprintf(stderr, "Usage: %s [-a mm|libc|both] [-n <runs>] <trace>...\n", argv[0]);
+			return 1;
+		}
+	}
+	if (optind == argc || runs <= 0) {
+		fprintf(stderr, "Usage: %s [-a mm|libc|both] [-n <runs>] <trace>...\n", argv[0]);
+		return 1;
+	}
+
+	calibrate();
+	mem_init();
+
+	for (; optind < argc; optind++) {
+		if (load_trace(argv[optind], &t) < 0) {
+			ret = 1;
+			continue;
+		}
+		for (i = 0; i < NUMALLOCATORS; i++) {
+			if (strcmp(which, "both") != 0 && strcmp(which, allocators[i].name) != 0)
+				continue;
+			if (allocators[i].init == libc_init) {
+				if (bench_forked(&allocators[i], &t, runs) < 0)
+					ret = 1;
+			}
+			else if (bench(&allocators[i], &t, runs) < 0)
+				ret = 1;
+		}
+		map_free(t.ops, t.opsbytes);
+	}
+
+	return ret;
+}
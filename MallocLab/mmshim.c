@@ -0,0 +1,317 @@
+/*
+ * LD_PRELOAD Shim
+ *
+ * Packages mm.c as a shared library that replaces the malloc family of the C library, so the allocator
+ * can run real programs:
+ *
+ *	gcc -O2 -shared -fPIC -DMMAP_LARGE -DHEAP_MAXSIZE='(1UL<<30)' -o libmm.so mmshim.c mm.c -lpthread
+ *	LD_PRELOAD=./libmm.so cc1 ...
+ *
+ * The shim takes the place of memlib as well. The heap is a region of HEAP_MAXSIZE bytes reserved at start-up
+ * without any access; mem_sbrk maps the pages below the new break read-write as the break passes them.
+ * HEAP_MAXSIZE must be the same for mmshim.c and mm.c, and at most 4GB since mm.c keeps offsets in words.
+ *
+ * mm.c is not thread-safe, so every call into it is made under one lock. The lock is taken around fork()
+ * with pthread_atfork, so the child never inherits it locked by a thread that doesn't exist in the child.
+ * mm.c must be built without ARENAS: thread-local variables of a preloaded library may be allocated with
+ * malloc on first use.
+ *
+ * Nothing here may call malloc, so errors are written with write(2).
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+#include "mm.h"
+#include "mm_ext.h"
+#include "memlib.h"
+
+#ifndef HEAP_MAXSIZE
+#define HEAP_MAXSIZE (20*(1<<20))	/* Must match mm.c */
+#endif
+#define PAGESIZE (1<<12)
+#define MAXREQUEST ((size_t)UINT32_MAX - (1<<16))	/* Block sizes are 32-bit words in mm.c */
+
+/* Round up to a page boundary */
+#define PAGE_UP(ptr)	((char *)(((size_t)(ptr) + PAGESIZE - 1) & ~(size_t)(PAGESIZE - 1)))
+
+/* The reserved region, the break, and the end of the pages mapped read-write */
+static char *heap_lo = 0;
+static char *heap_brk = 0;
+static char *heap_mapped = 0;
+
+/* Serializes every call into mm.c */
+static pthread_mutex_t shim_lock = PTHREAD_MUTEX_INITIALIZER;
+static int initialized = 0;
+
+static int shim_init(void);
+static void fail(const char *msg);
+
+/*
+ * mem_init - Reserve the region of the heap. The pages are mapped read-write by mem_sbrk.
+ */
+void mem_init(void)
+{
+    heap_lo = mmap(NULL, HEAP_MAXSIZE, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (heap_lo == MAP_FAILED)
+	fail("mmshim: can't reserve the heap\n");
+    heap_brk = heap_mapped = heap_lo;
+}
+
+/*
+ * mem_deinit - Release the region of the heap
+ */
+void mem_deinit(void)
+{
+    munmap(heap_lo, HEAP_MAXSIZE);
+    heap_lo = heap_brk = heap_mapped = 0;
+}
+
+/*
+ * mem_sbrk - Extend the heap by incr bytes, mapping the pages it reaches. Return the old break.
+ */
+void *mem_sbrk(int incr)
+{
+    char *old = heap_brk;
+    char *end;
+
+    if (incr < 0 || (size_t)(heap_brk - heap_lo) + incr > HEAP_MAXSIZE) {
+	errno = ENOMEM;
+	return (void *)-1;
+    }
+
+    end = PAGE_UP(heap_brk + incr);
+    if (end > heap_mapped) {
+	if (mmap(heap_mapped, end - heap_mapped, PROT_READ | PROT_WRITE,
+		 MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0) == MAP_FAILED) {
+	    errno = ENOMEM;
+	    return (void *)-1;
+	}
+	heap_mapped = end;
+    }
+
+    heap_brk += incr;
+    return old;
+}
+
+/*
+ * mem_reset_brk - Empty the heap; the pages stay mapped
+ */
+void mem_reset_brk(void)
+{
+    heap_brk = heap_lo;
+}
+
+void *mem_heap_lo(void)
+{
+    return heap_lo;
+}
+
+void *mem_heap_hi(void)
+{
+    return heap_brk - 1;
+}
+
+size_t mem_heapsize(void)
+{
+    return heap_brk - heap_lo;
+}
+
+size_t mem_pagesize(void)
+{
+    return PAGESIZE;
+}
+
+/*
+ * fail - Report an error without allocating, and abort
+ */
+static void fail(const char *msg)
+{
+    if (write(STDERR_FILENO, msg, strlen(msg)) < 0)
+	abort();
+    abort();
+}
+
+/*
+ * Fork handlers: no other thread may be inside mm.c while the heap is copied into the child
+ */
+static void fork_prepare(void)
+{
+    pthread_mutex_lock(&shim_lock);
+}
+
+static void fork_parent(void)
+{
+    pthread_mutex_unlock(&shim_lock);
+}
+
+static void fork_child(void)
+{
+    pthread_mutex_init(&shim_lock, NULL);
+}
+
+/*
+ * shim_init - Initialize the heap on the first call. Called with shim_lock held.
+ */
+static int shim_init(void)
+{
+    if (!initialized) {
+	mem_init();
+	if (mm_init() == -1)
+	    fail("mmshim: mm_init failed\n");
+	initialized = 1;
+    }
+    return 0;
+}
+
+/*
+ * shim_constructor - Initialize the heap before main, and register the fork handlers.
+ * 		      pthread_atfork may allocate, so it is called without shim_lock held.
+ */
+__attribute__((constructor))
+static void shim_constructor(void)
+{
+    pthread_mutex_lock(&shim_lock);
+    shim_init();
+    pthread_mutex_unlock(&shim_lock);
+
+    pthread_atfork(fork_prepare, fork_parent, fork_child);
+}
+
+void *malloc(size_t size)
+{
+    void *ptr;
+
+    if (size > MAXREQUEST) {
+	errno = ENOMEM;
+	return NULL;
+    }
+
+    pthread_mutex_lock(&shim_lock);
+    shim_init();
+    ptr = mm_malloc(size ? size : 1);
+    pthread_mutex_unlock(&shim_lock);
+
+    if (ptr == NULL)
+	errno = ENOMEM;
+    return ptr;
+}
+
+void free(void *ptr)
+{
+    if (ptr == NULL)
+	return;
+
+    pthread_mutex_lock(&shim_lock);
+    mm_free(ptr);
+    pthread_mutex_unlock(&shim_lock);
+}
+
+void *calloc(size_t nmemb, size_t size)
+{
+    void *ptr;
+
+    if (size != 0 && nmemb > MAXREQUEST / size) {
+	errno = ENOMEM;
+	return NULL;
+    }
+    size *= nmemb;
+
+    /* Not through malloc: the compiler may turn malloc and memset into a call to calloc */
+    pthread_mutex_lock(&shim_lock);
+    shim_init();
+    ptr = mm_malloc(size ? size : 1);
+    pthread_mutex_unlock(&shim_lock);
+
+    if (ptr == NULL) {
+	errno = ENOMEM;
+	return NULL;
+    }
+    memset(ptr, 0, size);
+    return ptr;
+}
+
+void *realloc(void *ptr, size_t size)
+{
+    void *newptr;
+
+    if (ptr == NULL)
+	return malloc(size);
+    if (size > MAXREQUEST) {
+	errno = ENOMEM;
+	return NULL;
+    }
+
+    pthread_mutex_lock(&shim_lock);
+    newptr = mm_realloc(ptr, size);
+    pthread_mutex_unlock(&shim_lock);
+
+    if (newptr == NULL && size != 0)
+	errno = ENOMEM;
+    return newptr;
+}
+
+int posix_memalign(void **memptr, size_t align, size_t size)
+{
+    void *ptr;
+
+    if (align < sizeof(void *) || (align & (align - 1)) != 0)
+	return EINVAL;
+    if (size > MAXREQUEST || align > MAXREQUEST - size)
+	return ENOMEM;
+
+    pthread_mutex_lock(&shim_lock);
+    shim_init();
+    ptr = mm_memalign(align, size ? size : 1);
+    pthread_mutex_unlock(&shim_lock);
+
+    if (ptr == NULL)
+	return ENOMEM;
+    *memptr = ptr;
+    return 0;
+}
+
+void *aligned_alloc(size_t align, size_t size)
+{
+    void *ptr;
+    int err;
+
+    if ((err = posix_memalign(&ptr, align < sizeof(void *) ? sizeof(void *) : align, size)) != 0) {
+	errno = err;
+	return NULL;
+    }
+    return ptr;
+}
+
+void *memalign(size_t align, size_t size)
+{
+    return aligned_alloc(align, size);
+}
+
+void *valloc(size_t size)
+{
+    return aligned_alloc(PAGESIZE, size);
+}
+
+void *pvalloc(size_t size)
+{
+    return aligned_alloc(PAGESIZE, (size + PAGESIZE - 1) & ~(size_t)(PAGESIZE - 1));
+}
+
+size_t malloc_usable_size(void *ptr)
+{
+    size_t size;
+
+    if (ptr == NULL)
+	return 0;
+
+    pthread_mutex_lock(&shim_lock);
+    size = mm_usable_size(ptr);
+    pthread_mutex_unlock(&shim_lock);
+
+    return size;
+}